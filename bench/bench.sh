@@ -0,0 +1,65 @@
+#!/bin/sh
+# Time regview over a fixed set of synthetic hives. Each test is run
+# RUNS times (default 5) and the best time is reported, along with
+# throughput in keys and megabytes of hive per second.
+#
+# Usage: bench/bench.sh [regview binary]
+set -e
+
+dir=$(dirname "$0")
+regview=${1:-$dir/regview}
+genhive=$dir/genhive
+data=$dir/data
+runs=${RUNS:-5}
+
+mkdir -p "$data"
+
+# name and generator arguments of each hive
+hives="small:-d 4 -f 10 -n 2
+wide:-d 2 -f 600 -n 1 -l 1,1,1,1
+deep:-d 16 -f 2 -n 1
+mixed:-d 3 -f 50 -n 3 -s 64 -l 4,4,1,1
+bigdata:-d 2 -f 40 -n 2 -s 40000"
+
+now() {
+    date +%s%N
+}
+
+# Best wall time, in nanoseconds, of running "$@" $runs times
+best() {
+    b=
+    i=0
+    while [ $i -lt "$runs" ]; do
+        t0=$(now)
+        "$@" > /dev/null
+        t=$(($(now) - t0))
+        if [ -z "$b" ] || [ $t -lt $b ]; then b=$t; fi
+        i=$((i + 1))
+    done
+    echo $b
+}
+
+report() {
+    # name test keys bytes ns
+    awk -v n="$1" -v t="$2" -v k="$3" -v b="$4" -v ns="$5" 'BEGIN {
+        s = ns / 1e9
+        printf "%-8s %-8s %10d %9.1f %10.3f %12.0f %9.1f\n", n, t, k, b / 1048576, s * 1000, k / s, b / 1048576 / s
+    }'
+}
+
+printf "%-8s %-8s %10s %9s %10s %12s %9s\n" hive test keys MB ms keys/s MB/s
+echo "$hives" | while IFS=: read name args; do
+    hive=$data/$name.hiv
+    if [ ! -f "$hive" ] || [ ! -f "$data/$name.info" ]; then
+        $genhive $args "$hive" > "$data/$name.info"
+    fi
+    keys=$(sed -n 's/^keys //p' "$data/$name.info")
+    path=$(sed -n 's/^path //p' "$data/$name.info")
+    bytes=$(wc -c < "$hive")
+
+    report "$name" dump "$keys" "$bytes" "$(best "$regview" "$hive")"
+    report "$name" dump-v "$keys" "$bytes" "$(best "$regview" -v "$hive")"
+    report "$name" lookup 1 "$bytes" "$(best "$regview" "$hive" "$path")"
+    report "$name" sweep "$keys" "$bytes" "$(best "$regview" --sweep "$hive")"
+    report "$name" index "$keys" "$bytes" "$(best "$regview" --index-stats "$hive")"
+done
@@ -0,0 +1,409 @@
+// Synthetic hive generator for the benchmarks. Writes a valid hive
+// (header with a correct checksum, 4K-aligned hbins, sorted subkey
+// lists) with a given shape, so runs are repeatable from a seed.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#define HBIN_HEADER_SIZE 0x20
+#define DB_SEGMENT_SIZE 16344
+#define RI_SUBLIST_SIZE 512
+
+#define LIST_LF 0
+#define LIST_LH 1
+#define LIST_LI 2
+#define LIST_RI 3
+
+const char *listNames[4] = { "lf", "lh", "li", "ri" };
+
+typedef struct genOptions {
+    int depth;
+    int fanout;
+    int lists[4];           // relative weights of each list kind
+    int values;             // per key
+    uint32_t value_size;    // 4 or less is stored inline
+    uint32_t seed;
+} GenOptions;
+
+// The hbins are built up in one buffer; offsets into it are the same
+// as the offsets stored in the hive
+typedef struct gen {
+    const GenOptions *opts;
+    unsigned char *buf;
+    size_t len;
+    size_t cap;
+    size_t bin_start;
+    size_t pos;             // next free byte in the current hbin
+    uint32_t rng;
+    uint32_t security;
+    uint64_t keys;
+    uint64_t values;
+    char deepest[4096];     // path of a key at the bottom, for lookups
+} Gen;
+
+uint32_t nextRandom(Gen *g) {
+    // xorshift32
+    g->rng ^= g->rng << 13;
+    g->rng ^= g->rng >> 17;
+    g->rng ^= g->rng << 5;
+    return g->rng;
+}
+
+void put16(Gen *g, size_t off, uint16_t v) {
+    memcpy(g->buf + off, &v, sizeof(v));
+}
+
+void put32(Gen *g, size_t off, uint32_t v) {
+    memcpy(g->buf + off, &v, sizeof(v));
+}
+
+void put64(Gen *g, size_t off, uint64_t v) {
+    memcpy(g->buf + off, &v, sizeof(v));
+}
+
+// Start a new hbin with room for at least need bytes of cells
+void newHbin(Gen *g, size_t need) {
+    size_t size = (need + HBIN_HEADER_SIZE + 0xFFF) & ~(size_t) 0xFFF;
+
+    // Whatever is left of the last one becomes a free cell
+    if (g->len && g->pos < g->len)
+        put32(g, g->pos, (uint32_t) (g->len - g->pos));
+
+    if (g->len + size > g->cap) {
+        while (g->len + size > g->cap) g->cap = g->cap ? g->cap * 2 : 1 << 20;
+        g->buf = (unsigned char *) realloc(g->buf, g->cap);
+        if (!g->buf) exit(1);
+    }
+    memset(g->buf + g->len, 0, size);
+    memcpy(g->buf + g->len, "hbin", 4);
+    put32(g, g->len + 4, (uint32_t) g->len);
+    put32(g, g->len + 8, (uint32_t) size);
+    put32(g, g->len + 0x1c, (uint32_t) size);
+    g->bin_start = g->len;
+    g->pos = g->len + HBIN_HEADER_SIZE;
+    g->len += size;
+}
+
+// Allocate a cell for len bytes of payload. Return value: its offset,
+// which points at the cell size like offsets in the hive do.
+uint32_t allocCell(Gen *g, size_t len) {
+    size_t need = (len + 4 + 7) & ~(size_t) 7;
+    if (!g->len || g->pos + need > g->len) newHbin(g, need);
+
+    uint32_t off = (uint32_t) g->pos;
+    memset(g->buf + off, 0, need);
+    put32(g, off, (uint32_t) -(int32_t) need);
+    g->pos += need;
+    return off;
+}
+
+// Pointer to a cell's payload
+unsigned char *cellData(Gen *g, uint32_t off) {
+    return g->buf + off + 4;
+}
+
+int compareNames(const void *a, const void *b) {
+    const char *na = *(const char *const *) a, *nb = *(const char *const *) b;
+    for (; *na && *nb; na++, nb++) {
+        int ca = toupper((unsigned char) *na), cb = toupper((unsigned char) *nb);
+        if (ca != cb) return ca - cb;
+    }
+    return (*na != 0) - (*nb != 0);
+}
+
+uint32_t lhHash(const char *name) {
+    uint32_t h = 0;
+    for (; *name; name++) h = h * 37 + toupper((unsigned char) *name);
+    return h;
+}
+
+uint32_t makeSecurity(Gen *g) {
+    // Owner SYSTEM, and a DACL letting Everyone read
+    static const unsigned char sd[] = {
+        1, 0, 0x04, 0x80, 20, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 32, 0, 0, 0,
+        1, 1, 0, 0, 0, 0, 0, 5, 18, 0, 0, 0,
+        2, 0, 28, 0, 1, 0, 0, 0,
+        0, 0, 20, 0, 0x19, 0, 2, 0, 1, 1, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0
+    };
+    uint32_t off = allocCell(g, 20 + sizeof(sd));
+    unsigned char *p = cellData(g, off);
+    memcpy(p, "sk", 2);
+    put32(g, off + 4 + 4, off);
+    put32(g, off + 4 + 8, off);
+    put32(g, off + 4 + 12, 1);
+    put32(g, off + 4 + 16, sizeof(sd));
+    memcpy(p + 20, sd, sizeof(sd));
+    return off;
+}
+
+uint32_t makeNK(Gen *g, const char *name, uint32_t parent, int root) {
+    size_t name_len = strlen(name);
+    uint32_t off = allocCell(g, 76 + name_len);
+    size_t p = off + 4;
+
+    memcpy(g->buf + p, "nk", 2);
+    put16(g, p + 2, root ? 0x2c : 0x20);
+    put64(g, p + 4, 131000000000000000ULL + (uint64_t) (nextRandom(g) % 1000000000) * 2000000);
+    put32(g, p + 16, parent);
+    put32(g, p + 28, 0xFFFFFFFF);
+    put32(g, p + 32, 0xFFFFFFFF);
+    put32(g, p + 40, 0xFFFFFFFF);
+    put32(g, p + 44, g->security);
+    put32(g, p + 48, 0xFFFFFFFF);
+    put16(g, p + 72, (uint16_t) name_len);
+    memcpy(g->buf + p + 76, name, name_len);
+    g->keys++;
+    return off;
+}
+
+// Data of len bytes for a value: a plain cell, or for anything too big
+// for one, a db record and its segments
+uint32_t makeValueData(Gen *g, uint32_t len) {
+    if (len <= DB_SEGMENT_SIZE) {
+        uint32_t off = allocCell(g, len);
+        for (uint32_t i = 0; i < len; i++) cellData(g, off)[i] = (unsigned char) nextRandom(g);
+        return off;
+    }
+
+    uint32_t nsegs = (len + DB_SEGMENT_SIZE - 1) / DB_SEGMENT_SIZE;
+    uint32_t *segs = (uint32_t *) malloc(nsegs * sizeof(uint32_t));
+    if (!segs) exit(1);
+    for (uint32_t s = 0; s < nsegs; s++) {
+        uint32_t seg_len = s + 1 < nsegs ? DB_SEGMENT_SIZE : len - s * DB_SEGMENT_SIZE;
+        segs[s] = makeValueData(g, seg_len);
+    }
+    uint32_t list = allocCell(g, nsegs * sizeof(uint32_t));
+    memcpy(cellData(g, list), segs, nsegs * sizeof(uint32_t));
+    uint32_t db = allocCell(g, 8);
+    memcpy(cellData(g, db), "db", 2);
+    put16(g, db + 4 + 2, (uint16_t) nsegs);
+    put32(g, db + 4 + 4, list);
+    free(segs);
+    return db;
+}
+
+void makeValues(Gen *g, uint32_t key) {
+    int n = g->opts->values;
+    if (!n) return;
+
+    uint32_t *vks = (uint32_t *) malloc(n * sizeof(uint32_t));
+    if (!vks) exit(1);
+    for (int i = 0; i < n; i++) {
+        char name[16];
+        uint32_t size = g->opts->value_size;
+        int len = snprintf(name, sizeof(name), "Val%d", i);
+        uint32_t vk = allocCell(g, 20 + len);
+        size_t p = vk + 4;
+
+        memcpy(g->buf + p, "vk", 2);
+        put16(g, p + 2, (uint16_t) len);
+        if (size <= 4) {
+            put32(g, p + 4, 0x80000000 | size);
+            put32(g, p + 8, nextRandom(g));
+            put32(g, p + 12, 4);        // REG_DWORD
+        }
+        else {
+            uint32_t data = makeValueData(g, size);
+            put32(g, p + 4, size);
+            put32(g, p + 8, data);
+            put32(g, p + 12, 3);        // REG_BINARY
+        }
+        put16(g, p + 16, 1);            // name is ASCII
+        memcpy(g->buf + p + 20, name, len);
+        vks[i] = vk;
+        g->values++;
+    }
+    uint32_t list = allocCell(g, n * sizeof(uint32_t));
+    memcpy(cellData(g, list), vks, n * sizeof(uint32_t));
+    put32(g, key + 4 + 36, n);
+    put32(g, key + 4 + 40, list);
+    free(vks);
+}
+
+// Pick a list kind by the weights, from the first n kinds
+int pickList(Gen *g, int n) {
+    const int *w = g->opts->lists;
+    int total = 0;
+    for (int k = 0; k < n; k++) total += w[k];
+    if (!total) return LIST_LF;
+
+    int r = nextRandom(g) % total;
+    for (int k = 0; k < n; k++) {
+        if (r < w[k]) return k;
+        r -= w[k];
+    }
+    return LIST_LF;
+}
+
+// A leaf list of one kind over keys[0..n), whose names are in names
+uint32_t makeLeafList(Gen *g, int kind, const uint32_t *keys, char **names, int n) {
+    int stride = kind == LIST_LI ? 4 : 8;
+    uint32_t off = allocCell(g, 4 + n * stride);
+    size_t p = off + 4;
+
+    memcpy(g->buf + p, listNames[kind], 2);
+    put16(g, p + 2, (uint16_t) n);
+    for (int i = 0; i < n; i++) {
+        put32(g, p + 4 + i * stride, keys[i]);
+        if (kind == LIST_LF)
+            strncpy((char *) g->buf + p + 8 + i * stride, names[i], 4);
+        else if (kind == LIST_LH)
+            put32(g, p + 8 + i * stride, lhHash(names[i]));
+    }
+    return off;
+}
+
+uint32_t makeList(Gen *g, const uint32_t *keys, char **names, int n) {
+    int kind = pickList(g, 4);
+    if (kind != LIST_RI && n <= 0xFFFF)
+        return makeLeafList(g, kind, keys, names, n);
+
+    // An ri list of leaf lists, none of them ri
+    int nsubs = (n + RI_SUBLIST_SIZE - 1) / RI_SUBLIST_SIZE;
+    if (nsubs < 2 && n > 1) nsubs = 2;
+    uint32_t *subs = (uint32_t *) malloc(nsubs * sizeof(uint32_t));
+    if (!subs) exit(1);
+    for (int s = 0; s < nsubs; s++) {
+        int lo = (int) ((int64_t) n * s / nsubs), hi = (int) ((int64_t) n * (s + 1) / nsubs);
+        subs[s] = makeLeafList(g, pickList(g, 3), keys + lo, names + lo, hi - lo);
+    }
+    uint32_t off = allocCell(g, 4 + nsubs * 4);
+    memcpy(cellData(g, off), "ri", 2);
+    put16(g, off + 4 + 2, (uint16_t) nsubs);
+    memcpy(cellData(g, off) + 4, subs, nsubs * sizeof(uint32_t));
+    free(subs);
+    return off;
+}
+
+// Make the subkeys of key, at the given level, and everything below
+void makeSubtree(Gen *g, uint32_t key, int level, char *path, size_t path_len) {
+    int n = g->opts->fanout;
+    if (level >= g->opts->depth || n <= 0) {
+        if (path_len < sizeof(g->deepest) && level > 0 && !g->deepest[0])
+            memcpy(g->deepest, path, path_len + 1);
+        return;
+    }
+
+    char **names = (char **) malloc(n * sizeof(char *));
+    uint32_t *keys = (uint32_t *) malloc(n * sizeof(uint32_t));
+    if (!names || !keys) exit(1);
+    for (int i = 0; i < n; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "Key%c%u", "abcXYZ"[nextRandom(g) % 6], i);
+        names[i] = strdup(name);
+    }
+    qsort(names, n, sizeof(char *), compareNames);
+
+    for (int i = 0; i < n; i++) {
+        size_t len = strlen(names[i]);
+        keys[i] = makeNK(g, names[i], key, 0);
+        makeValues(g, keys[i]);
+        if (path_len + 1 + len + 1 < 4096) {
+            path[path_len] = '\\';
+            memcpy(path + path_len + 1, names[i], len + 1);
+            makeSubtree(g, keys[i], level + 1, path, path_len + 1 + len);
+            path[path_len] = '\0';
+        }
+        else {
+            makeSubtree(g, keys[i], level + 1, path, path_len);
+        }
+    }
+
+    uint32_t list = makeList(g, keys, names, n);
+    put32(g, key + 4 + 20, n);
+    put32(g, key + 4 + 28, list);
+    for (int i = 0; i < n; i++) free(names[i]);
+    free(names);
+    free(keys);
+}
+
+// Write the header and hbins out to path
+void writeHive(Gen *g, const char *path, uint32_t root) {
+    uint32_t hdr[0x1000 / 4];
+
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, "regf", 4);
+    hdr[1] = hdr[2] = 1;                // update counts: clean
+    hdr[3] = 0x9f3e2000;                // modified: 2019
+    hdr[4] = 0x01d4f53b;
+    hdr[5] = 1;                         // version 1.5, so db records are allowed
+    hdr[6] = 5;
+    hdr[9] = root;
+    hdr[10] = (uint32_t) g->len;
+    hdr[11] = 1;
+    for (int i = 0; i < 0x1fc / 4; i++) hdr[0x1fc / 4] ^= hdr[i];
+
+    FILE *f = fopen(path, "wb");
+    if (!f || fwrite(hdr, 1, sizeof(hdr), f) != sizeof(hdr) ||
+        fwrite(g->buf, 1, g->len, f) != g->len || fclose(f)) {
+        perror(path);
+        exit(1);
+    }
+}
+
+void usage(const char *prog) {
+    printf("Usage: %s [-d depth] [-f fanout] [-l lf,lh,li,ri weights] [-n values per key]\n"
+        "       [-s value size] [-r seed] <output file>\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    GenOptions opts = { 3, 10, { 1, 1, 1, 1 }, 1, 4, 1 };
+    Gen g;
+    char path[4096];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:f:l:n:s:r:")) != -1) {
+        switch (opt) {
+        case 'd':
+            opts.depth = atoi(optarg);
+            break;
+        case 'f':
+            opts.fanout = atoi(optarg);
+            break;
+        case 'l':
+            if (sscanf(optarg, "%d,%d,%d,%d", &opts.lists[0], &opts.lists[1],
+                &opts.lists[2], &opts.lists[3]) != 4)
+                usage(argv[0]);
+            if (opts.lists[0] + opts.lists[1] + opts.lists[2] + opts.lists[3] <= 0)
+                usage(argv[0]);
+            break;
+        case 'n':
+            opts.values = atoi(optarg);
+            break;
+        case 's':
+            opts.value_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            opts.seed = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || opts.depth < 0 || opts.fanout < 0 || opts.values < 0)
+        usage(argv[0]);
+
+    memset(&g, 0, sizeof(g));
+    g.opts = &opts;
+    g.rng = opts.seed ? opts.seed : 1;
+
+    // The root goes first, so it sits right after the first hbin header
+    newHbin(&g, 0x1000 - HBIN_HEADER_SIZE);
+    uint32_t root = makeNK(&g, "ROOT", 0xFFFFFFFF, 1);
+    g.security = makeSecurity(&g);
+    put32(&g, root + 4 + 44, g.security);
+    makeValues(&g, root);
+    strcpy(path, "");
+    makeSubtree(&g, root, 0, path, 0);
+    if (g.pos < g.len) put32(&g, g.pos, (uint32_t) (g.len - g.pos));
+
+    writeHive(&g, argv[optind], root);
+    printf("keys %llu\nvalues %llu\npath %s\n", (unsigned long long) g.keys,
+        (unsigned long long) g.values, g.deepest + (g.deepest[0] == '\\'));
+    free(g.buf);
+    return 0;
+}
@@ -0,0 +1,354 @@
+// Declarations shared by libregview.c and the regview command line:
+// the hive's on-disk structures, and the parts of the library the
+// command line drives directly rather than through the cursor API in
+// regview.h. Those are prefixed rv_ so as not to clash with the names
+// in a program that links the library; everything else in
+// libregview.c is static.
+#ifndef REGVIEW_INTERNAL_H
+#define REGVIEW_INTERNAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "regview.h"
+
+typedef struct _FILETIME {
+    uint32_t dwLowDateTime;
+    uint32_t dwHighDateTime;
+} FILETIME;
+
+#define NK_ROOT 0x2c
+#define NK_NODE 0x20
+#define NK_LINK 0x10
+#define NK_COMP_NAME 0x20     // name is Latin-1 rather than UTF-16LE
+
+typedef struct hiveVersion {
+    uint32_t major;
+    uint32_t minor;
+    uint32_t release;
+    uint32_t build;
+} HiveVersion;
+
+// Represents a node/key. Links to other node/keys (ie subkeys), and
+// also to values and security descriptors.
+typedef struct nk_cell {
+    char signature[2];  // 'nk'
+    short type;         // 0x2c for root, 0x20 for non-root, 0x10 for symlinks
+    FILETIME modified;
+    uint32_t u1;
+    uint32_t parent;
+    int32_t num_subkeys;
+    uint32_t u2;
+    uint32_t subkeys;
+    uint32_t u3;
+    int32_t num_values;
+    uint32_t values;
+    uint32_t security;
+    uint32_t classname;
+    uint32_t u4[5];
+    unsigned short name_len;
+    unsigned short classname_len;
+    char name[1];
+} NK;
+
+// Note: lh and lf records only differ in the type of hash used
+// (see searchLeaf).
+typedef struct lh_cell {
+    char signature[2];
+    short num_entries;
+} LH;
+
+typedef struct ri_cell {
+    char signature[2];
+    short num_entries;
+    uint32_t entries[1];
+} RI;
+
+typedef struct hashrec {
+    uint32_t offset;
+    char hash[4];       // First 4 chars of keyname for lf, base37 
+} HashRec;
+
+// Represents a value: its name, type and where to find the data
+typedef struct vk_cell {
+    char signature[2];  // 'vk'
+    unsigned short name_len;
+    uint32_t data_len;  // high bit set if the data is stored in data_off itself
+    uint32_t data_off;
+    uint32_t type;
+    unsigned short flags;
+    unsigned short u1;
+    char name[1];
+} VK;
+
+#define VK_DATA_INLINE 0x80000000
+#define VK_COMP_NAME 0x0001   // in flags; name is Latin-1 rather than UTF-16LE
+
+// Data too big for one cell is split into segments, listed by a db
+// record. Every segment but the last holds DB_SEGMENT_SIZE bytes.
+typedef struct db_cell {
+    char signature[2];  // 'db'
+    unsigned short num_segments;
+    uint32_t segments;
+} DB;
+
+#define DB_SEGMENT_SIZE 16344
+
+// A security descriptor, shared by every key that points at it. The
+// cells form a list, with a count of the keys using each one.
+typedef struct sk_cell {
+    char signature[2];  // 'sk'
+    unsigned short u1;
+    uint32_t next;
+    uint32_t prev;
+    uint32_t refcount;
+    uint32_t descriptor_len;
+    unsigned char descriptor[1];    // self-relative SECURITY_DESCRIPTOR
+} SK;
+
+typedef struct hiveHeader {
+    char signature[4];              // 'regf'
+    uint32_t update_count1;
+    uint32_t update_count2;
+    FILETIME modified;
+    HiveVersion version;
+    uint32_t data_offset;
+    uint32_t last_block;
+    uint32_t unknown;           // Always 1
+    unsigned char padding[0x1cc];
+    uint32_t checksum;          // XOR of 0x00 through 0x1FC
+} HiveHeader;
+
+typedef struct blockHeader {
+    char signature[4];          // 'hbin'
+    uint32_t off;           // offset from the first hbin block
+    uint32_t next;          // offset to the next hbin block
+    uint32_t padding[2];    // unknown
+    FILETIME modified;          // last modified time
+    uint32_t block_size;
+} BlockHeader;
+
+// Counters for --stats. Each thread counts into its own copy, which
+// it adds to the totals when it finishes; with stats off, all that's
+// left in the hot paths is a check of rv_collect_stats.
+#define FANOUT_BUCKETS 18
+
+typedef struct stats {
+    uint64_t keys;
+    uint64_t cell_reads;
+    uint64_t bytes_read;
+    uint64_t far_jumps;             // reads more than a page from the last
+    uint64_t lists[4];              // lf, lh, li, ri
+    uint64_t allocs;
+    uint64_t prefetches;            // --prefetch requests made
+    uint64_t walk_ns;
+    uint64_t walk_output_ns;        // output written from inside a walk
+    uint64_t output_ns;
+    uint64_t fanout[FANOUT_BUCKETS];    // keys by log2 of subkey count
+    uint32_t max_depth;
+    uint32_t last_read;
+    int walking;
+} Stats;
+
+// A hive file mapped privately into memory. Cells are accessed in
+// place through getCell rather than being read into buffers. The
+// mapping is only written to when replaying transaction logs, or when
+// the hive is read from a pipe into anonymous memory laid out the same.
+typedef struct hive {
+    int fd;                     // -1 if read from a pipe
+    const unsigned char *base;
+    size_t size;
+} Hive;
+
+// Output goes through a Writer, which builds it up in a large buffer
+// and hands it to a sink in big pieces. A Writer with no sink just
+// keeps growing its buffer, for output that is put together in memory
+// and written out later.
+typedef int (*SinkFn)(void *ctx, const struct iovec *iov, int iovcnt);
+
+typedef struct writer {
+    char *buf;
+    size_t len;
+    size_t cap;
+    SinkFn sink;
+    void *sink_ctx;
+} Writer;
+
+// A sink that writes to a file descriptor: a file, a pipe, or the
+// input of a compressor (see rv_openOutput)
+typedef struct fdSink {
+    int fd;
+    pid_t child;
+} FdSink;
+
+// What to print about each key besides its name
+typedef struct printOptions {
+    int values;
+    int security;
+} PrintOptions;
+
+// Filters on which keys get printed. A glob is matched against the
+// key's full path, case-insensitively; * matches any run of characters,
+// backslashes included, and ? any one. Keys below the depth limit or
+// outside the time range aren't printed either.
+//
+// Filtering also prunes the walk: nothing below the depth limit is
+// read, nor is any subtree whose path can no longer match the glob.
+// While the glob is still literal at the next level, lf hints and lh
+// hashes rule out subkeys without reading their cells at all.
+typedef struct keyFilter {
+    const char *glob;           // NULL for any path
+    size_t literal;             // length of the glob before any wildcard
+    size_t glob_len;
+    int max_depth;              // -1 for no limit
+    uint64_t after;             // modified time range, in FILETIME ticks
+    uint64_t before;
+} KeyFilter;
+
+// Interned key names. Each distinct name is stored once in chars,
+// and name id i occupies chars[offsets[i]] up to chars[offsets[i+1]].
+typedef struct nameTable {
+    char *chars;
+    uint32_t *offsets;
+    uint32_t count;
+    uint32_t chars_len;
+    uint32_t chars_cap;
+    uint32_t offsets_cap;
+    uint32_t *slots;        // open-addressed hash of ids + 1, 0 = empty
+    uint32_t nslots;
+} NameTable;
+
+#define NO_KEY 0xFFFFFFFF
+
+// One key of a KeyIndex. Keys are stored in walk order, so a parent
+// always comes before its subkeys, and the root is key 0.
+typedef struct keyEntry {
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint32_t name;          // id in the index's name table
+    FILETIME modified;
+} KeyEntry;
+
+// The key tree of a hive, held in memory so it can be queried
+// without touching the hive again. An index loaded from a cache file
+// points into the file's mapping (map) rather than owning its arrays.
+typedef struct keyIndex {
+    KeyEntry *keys;
+    uint32_t count;
+    uint32_t cap;
+    NameTable names;
+    void *map;
+    size_t map_size;
+} KeyIndex;
+
+// A hive mounted into a MountTable
+typedef struct mount {
+    char *vpath;                // where, as given
+    const char *path;           // the hive file
+    Hive hive;
+    const NK *root;
+} Mount;
+
+// One step of the mount paths: the top of the namespace (node 0), a
+// key such as HKLM that is only there on the way to mounts below it,
+// or a mount point
+typedef struct mountNode {
+    const char *name;           // in some mount's vpath
+    size_t len;
+    int first_child;            // -1 for none; children are in key order
+    int next_sibling;
+    int mount;                  // index in mounts, or -1
+} MountNode;
+
+// Hives mounted together into one namespace, as SYSTEM and SOFTWARE
+// are under HKLM on a running system (see rv_printMountTree). Hives are
+// only ever added, and must all be added before anything is looked up.
+typedef struct mountTable {
+    Mount *mounts;
+    int count;
+    MountNode *nodes;
+    int nnodes;
+} MountTable;
+
+extern int rv_collect_stats;
+extern int rv_prefetch_cells;   // --prefetch
+extern __thread Stats rv_thread_stats;
+extern Stats rv_total_stats;
+void rv_mergeStats(void);
+
+// Cells a walk or lookup can't do without end the program when they
+// are bad, unless the thread points rv_hive_error_out somewhere: then
+// they are reported there, counted in rv_hive_errors, and the walk or
+// lookup cuts itself short.
+extern __thread Writer *rv_hive_error_out;
+extern __thread unsigned rv_hive_errors;
+
+// Hives. Flags for rv_openHive:
+#define HIVE_KEEP_FREE 1        // keep all of the free space of a streamed hive
+int rv_openHive(Hive *hive, const char *path, int flags, Writer *out);
+void rv_closeHive(Hive *hive);
+int rv_validHeader(const HiveHeader *hdr, Writer *out);
+int rv_replayLogs(Hive *hive, const char *path, const char *const *paths, int npaths, Writer *out);
+const NK *rv_findRoot(Hive *hive);
+const NK *rv_lookupKey(Hive *hive, const NK *root, const char *path);
+
+// Output. rv_openOutput arranges for output to go to path, or stdout if
+// it's NULL.
+extern Writer rv_output;
+void rv_initWriter(Writer *w, SinkFn sink, void *ctx);
+int rv_fdSinkWrite(void *ctx, const struct iovec *iov, int iovcnt);
+void rv_flushWriter(Writer *w);
+void rv_freeWriter(Writer *w);
+void rv_writeBytes(Writer *w, const void *p, size_t len);
+void rv_writeStr(Writer *w, const char *s);
+void rv_writeFmt(Writer *w, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void rv_writeJsonString(Writer *w, const char *s);
+void rv_openOutput(const char *path);
+void rv_closeOutput(void);
+
+// Printing a hive, or part of one
+void rv_printNTTime(const FILETIME *ft, Writer *out);
+void rv_printSubTree(const NK *root, Hive *hive, int level, const PrintOptions *opts,
+        Writer *out);
+void rv_printSubTreeParallel(const NK *root, Hive *hive, int level, int nthreads,
+        const PrintOptions *opts, Writer *out);
+void rv_printSubTreeJson(const NK *root, Hive *hive, Writer *out);
+void rv_printSubTreeFiltered(const NK *root, Hive *hive, const KeyFilter *f, int json,
+        const PrintOptions *opts, Writer *out);
+#define TIMELINE_BODYFILE 1
+#define TIMELINE_CSV 2
+void rv_printTimeline(const NK *root, Hive *hive, const KeyFilter *f, int format,
+        int nthreads, size_t budget, Writer *out);
+void rv_printSweep(Hive *hive, Writer *out);
+void rv_printCarve(Hive *hive, int nthreads, Writer *out);
+int rv_printVerify(Hive *hive, int nthreads, Writer *out);
+void rv_diffTrees(Hive *ha, const NK *ra, Hive *hb, const NK *rb, int prune, Writer *out);
+
+// Filters
+void rv_initKeyFilter(KeyFilter *f);
+void rv_setFilterGlob(KeyFilter *f, const char *glob);
+int rv_filterActive(const KeyFilter *f);
+int rv_parseFilterTime(const char *s, uint64_t *ticks);
+
+// Key indexes
+void rv_buildKeyIndex(Hive *hive, const NK *root, KeyIndex *idx);
+void rv_freeKeyIndex(KeyIndex *idx);
+uint32_t rv_lookupIndexKey(const KeyIndex *idx, const char *path);
+int rv_saveKeyIndex(const KeyIndex *idx, const HiveHeader *hdr, const char *path);
+int rv_loadKeyIndex(KeyIndex *idx, const HiveHeader *hdr, const char *path);
+void rv_printIndexTree(const KeyIndex *idx, uint32_t i, Writer *out);
+void rv_printIndexStats(const KeyIndex *idx, Writer *out);
+
+// Mounted hives
+void rv_initMountTable(MountTable *mt);
+int rv_addMount(MountTable *mt, const char *spec, Writer *out);
+void rv_freeMountTable(MountTable *mt);
+int rv_printMountTree(MountTable *mt, const char *path, int nthreads,
+        const PrintOptions *opts, Writer *out);
+void rv_buildMountIndex(MountTable *mt, KeyIndex *idx);
+
+#endif
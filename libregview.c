@@ -0,0 +1,5502 @@
+#define _GNU_SOURCE             // for mremap
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "internal.h"
+
+// Offsets in registry hives are relative to the first hbin block,
+// and point to the cell size (which we usually don't want).
+// Convert them to the true file offset of the structure.
+static uint32_t convOff(unsigned int off) {
+    return off + 0x1000 + 4;
+}
+
+int rv_collect_stats = 0;
+int rv_prefetch_cells = 0;
+__thread Stats rv_thread_stats;
+Stats rv_total_stats;
+__thread Writer *rv_hive_error_out;
+__thread unsigned rv_hive_errors;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void countRead(uint32_t start, size_t len) {
+    Stats *s = &rv_thread_stats;
+    s->cell_reads++;
+    s->bytes_read += len;
+    if (start - s->last_read + 0x1000 > 0x2000) s->far_jumps++;
+    s->last_read = start;
+}
+
+// Add this thread's counts to the totals. Every thread that did any
+// work calls this once it is done.
+void rv_mergeStats(void) {
+    Stats *s = &rv_thread_stats;
+    if (!rv_collect_stats) return;
+
+    pthread_mutex_lock(&stats_lock);
+    Stats *t = &rv_total_stats;
+    t->keys += s->keys;
+    t->cell_reads += s->cell_reads;
+    t->bytes_read += s->bytes_read;
+    t->far_jumps += s->far_jumps;
+    for (int i = 0; i < 4; i++) t->lists[i] += s->lists[i];
+    t->allocs += s->allocs;
+    t->prefetches += s->prefetches;
+    t->walk_ns += s->walk_ns;
+    t->walk_output_ns += s->walk_output_ns;
+    t->output_ns += s->output_ns;
+    for (int i = 0; i < FANOUT_BUCKETS; i++) t->fanout[i] += s->fanout[i];
+    if (s->max_depth > t->max_depth) t->max_depth = s->max_depth;
+    pthread_mutex_unlock(&stats_lock);
+    memset(s, 0, sizeof(*s));
+}
+
+// Read len bytes, or as many as there are before the end of the
+// stream. Return value: the number read, or -1 on error.
+static ssize_t readFull(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char *) buf + done, len - done);
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
+#define STREAM_PAGE 0x1000
+
+// Make the memory for a streamed hive at least size bytes long
+static int growStream(Hive *hive, size_t *cap, size_t size) {
+    if (size <= *cap) return 1;
+    size_t new_cap = *cap * 2 > size ? *cap * 2 : size;
+    void *base = mremap((void *) hive->base, *cap, new_cap, MREMAP_MAYMOVE);
+    if (base == MAP_FAILED) return 0;
+    hive->base = (const unsigned char *) base;
+    *cap = new_cap;
+    return 1;
+}
+
+// Round up to a multiple of the memory page size
+static size_t pageRound(size_t len) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (len + page - 1) & ~(page - 1);
+}
+
+// Hand back the whole pages of memory within len bytes of a streamed
+// hive, which then read as zeros
+static void dropStreamBytes(unsigned char *p, size_t len) {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    unsigned char *start = (unsigned char *) pageRound((uintptr_t) p);
+    unsigned char *end = (unsigned char *) (((uintptr_t) p + len) & ~(page - 1));
+    if (start < end && madvise(start, end - start, MADV_DONTNEED) < 0)
+        memset(start, 0, end - start);
+}
+
+// Drop the free space in an hbin that was read from a stream. What's
+// left of a free cell on pages it shares with other cells is kept, so
+// small deleted records can still be carved. Cells past any that don't
+// add up are kept whole.
+static void dropFreeCells(unsigned char *bin, size_t len) {
+    size_t pos = sizeof(BlockHeader);
+    while (pos + 4 <= len) {
+        int32_t size;
+        memcpy(&size, bin + pos, 4);
+        uint32_t cell_len = size < 0 ? -(uint32_t) size : (uint32_t) size;
+        if (cell_len < 8 || cell_len % 8 || cell_len > len - pos) break;
+        if (size > 0) dropStreamBytes(bin + pos + 4, cell_len - 4);
+        pos += cell_len;
+    }
+}
+
+// Read a hive from a pipe in one pass. It goes into anonymous memory
+// laid out just as the file is, so cells are found at their offsets
+// the same way, but memory is only kept for pages holding allocated
+// cells: whole pages of free cells and all-zero pages between hbins
+// are given back as they're read and then read as zeros. Free cells
+// can hold deleted records anywhere inside them, so with
+// HIVE_KEEP_FREE in flags, as for carving, they are kept whole.
+// Return value: as for mapHive.
+static int readHiveStream(Hive *hive, int flags, const char **why) {
+    int fd = hive->fd;
+    unsigned char header[STREAM_PAGE];     // the base block
+    ssize_t n = readFull(fd, header, sizeof(header));
+    size_t cap, pos = n;
+
+    hive->fd = -1;
+    if (n < (ssize_t) sizeof(HiveHeader)) {
+        *why = n < 0 ? "read" : NULL;
+        goto fail;
+    }
+
+    // Start from how big the header says the hbins are
+    cap = pageRound(0x1000 + (size_t) ((const HiveHeader *) header)->last_block + STREAM_PAGE);
+    void *base = mmap(NULL, cap, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        *why = "mmap";
+        goto fail;
+    }
+    hive->base = (const unsigned char *) base;
+    memcpy(base, header, n);
+
+    // A page at a time, except that an hbin is read whole once its
+    // header says how long it is
+    while (n == STREAM_PAGE) {
+        if (!growStream(hive, &cap, pos + STREAM_PAGE)) {
+            *why = "mremap";
+            goto unmap;
+        }
+        unsigned char *page = (unsigned char *) hive->base + pos;
+        n = readFull(fd, page, STREAM_PAGE);
+        if (n < 0) goto read_error;
+        pos += n;
+        if (n < STREAM_PAGE) break;
+
+        const BlockHeader *bh = (const BlockHeader *) page;
+        uint32_t bin_size = 0;
+        if (!strncmp(bh->signature, "hbin", 4)) {
+            if (bh->next >= STREAM_PAGE && bh->next % STREAM_PAGE == 0) bin_size = bh->next;
+            else if (bh->block_size >= STREAM_PAGE && bh->block_size % STREAM_PAGE == 0)
+                bin_size = bh->block_size;
+        }
+        if (!bin_size) {
+            static const unsigned char zeros[STREAM_PAGE];
+            if (!memcmp(page, zeros, STREAM_PAGE)) dropStreamBytes(page, STREAM_PAGE);
+            continue;
+        }
+        size_t start = pos - STREAM_PAGE;
+        if (!growStream(hive, &cap, start + bin_size)) {
+            *why = "mremap";
+            goto unmap;
+        }
+        ssize_t got = readFull(fd, (unsigned char *) hive->base + pos, bin_size - STREAM_PAGE);
+        if (got < 0) goto read_error;
+        pos += got;
+        if (!(flags & HIVE_KEEP_FREE))
+            dropFreeCells((unsigned char *) hive->base + start, pos - start);
+        if (pos - start < bin_size) break;
+    }
+
+    // Give back what was reserved past the end
+    size_t used = pageRound(pos);
+    if (used < cap) munmap((unsigned char *) hive->base + used, cap - used);
+    hive->size = pos;
+    close(fd);
+    return 1;
+
+read_error:
+    *why = "read";
+unmap:
+    {
+        int err = errno;
+        munmap((void *) hive->base, cap);
+        errno = err;
+    }
+fail:
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+    }
+    return 0;
+}
+
+// Map a hive file without saying anything about failures. A path of
+// "-", or one that isn't a regular file, is read as a stream instead
+// (see readHiveStream, which flags are for). Return value: 1 on
+// success, 0 on failure, with *why set to the call that failed (and
+// errno to why) or to NULL if the file is too small.
+static int mapHive(Hive *hive, const char *path, int flags, const char **why) {
+    struct stat st;
+
+    hive->fd = strcmp(path, "-") ? open(path, O_RDONLY) : dup(STDIN_FILENO);
+    if (hive->fd < 0) {
+        *why = "open";
+        return 0;
+    }
+    if (fstat(hive->fd, &st) < 0) {
+        *why = "fstat";
+    }
+    else if (!S_ISREG(st.st_mode)) {
+        return readHiveStream(hive, flags, why);
+    }
+    else if (st.st_size < (off_t) sizeof(HiveHeader)) {
+        *why = NULL;
+    }
+    else {
+        hive->size = st.st_size;
+        hive->base = mmap(NULL, hive->size, PROT_READ, MAP_PRIVATE, hive->fd, 0);
+        if (hive->base != MAP_FAILED) return 1;
+        *why = "mmap";
+    }
+
+    int err = errno;
+    close(hive->fd);
+    errno = err;
+    return 0;
+}
+
+// Map a hive file, writing why not to out if it can't be. Return
+// value: 1 on success, 0 on failure.
+int rv_openHive(Hive *hive, const char *path, int flags, Writer *out) {
+    const char *why;
+
+    if (mapHive(hive, path, flags, &why)) return 1;
+    if (why) rv_writeFmt(out, "%s: %s\n", why, strerror(errno));
+    else rv_writeFmt(out, "File too small to be a registry hive.\n");
+    return 0;
+}
+
+void rv_closeHive(Hive *hive) {
+    munmap((void *) hive->base, hive->size);
+    if (hive->fd >= 0) close(hive->fd);
+}
+
+// Return a pointer to the first len bytes of the cell at hive offset
+// off, or NULL if they don't lie entirely within the file.
+static const void *getCell(Hive *hive, uint32_t off, size_t len) {
+    uint32_t start = convOff(off);
+    if (rv_collect_stats) countRead(start, len);
+    if (start < off || start > hive->size || len > hive->size - start)
+        return NULL;
+    return hive->base + start;
+}
+
+// A cell's two-letter signature as one 16-bit number, read the way
+// the hive stores it, so that cells can be told apart with a switch
+// rather than string compares
+#define SIG(a, b) ((uint16_t) ((unsigned char) (a) | (unsigned char) (b) << 8))
+
+static inline uint16_t cellSignature(const void *cell) {
+    uint16_t sig;
+    memcpy(&sig, cell, sizeof(sig));
+    return sig;
+}
+
+// Return the nk cell at off, including its name, or NULL if it
+// is truncated or isn't an nk cell.
+static const NK *getNK(Hive *hive, uint32_t off) {
+    const NK *nk = (const NK *) getCell(hive, off, offsetof(NK, name));
+    if (!nk || cellSignature(nk) != SIG('n', 'k'))
+        return NULL;
+    if (!getCell(hive, off, offsetof(NK, name) + nk->name_len))
+        return NULL;
+    return nk;
+}
+
+// Report a bad cell the traversal can't do without, and exit. With
+// rv_hive_error_out set, only returns, after writing the first problem
+// there and counting every one.
+static void hiveError(const char *fmt, ...) {
+    char msg[128];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    if (!rv_hive_error_out) {
+        printf("%s\n", msg);
+        exit(1);
+    }
+    if (!rv_hive_errors++) rv_writeFmt(rv_hive_error_out, "%s\n", msg);
+}
+
+static const NK *needNK(Hive *hive, uint32_t off) {
+    const NK *nk = getNK(hive, off);
+    if (!nk) hiveError("Fatal: bad nk cell at 0x%x", off);
+    return nk;
+}
+
+// The hive offset of a cell returned by getCell; the inverse of convOff
+static uint32_t cellOffset(Hive *hive, const void *cell) {
+    return (uint32_t) ((const unsigned char *) cell - hive->base) - convOff(0);
+}
+
+// Return the vk cell at off, including its name, or NULL if it
+// is truncated or isn't a vk cell.
+static const VK *getVK(Hive *hive, uint32_t off) {
+    const VK *vk = (const VK *) getCell(hive, off, offsetof(VK, name));
+    if (!vk || cellSignature(vk) != SIG('v', 'k'))
+        return NULL;
+    if (!getCell(hive, off, offsetof(VK, name) + vk->name_len))
+        return NULL;
+    return vk;
+}
+
+// The offsets of a key's values, or NULL if it has none or the list
+// is out of range
+static const uint32_t *getValueList(Hive *hive, const NK *key) {
+    if (key->num_values <= 0 || key->values == 0xFFFFFFFF)
+        return NULL;
+    return (const uint32_t *) getCell(hive, key->values,
+        key->num_values * sizeof(uint32_t));
+}
+
+// Bump allocator for short-lived buffers. Allocations are carved out
+// of a chain of chunks and are never freed one by one; instead the
+// arena is wound back to a mark. Chunks are kept for reuse, so once a
+// walk has warmed up it stops calling malloc.
+typedef struct arenaChunk {
+    struct arenaChunk *next;
+    size_t size;
+    size_t used;
+    unsigned char data[];
+} ArenaChunk;
+
+typedef struct arena {
+    ArenaChunk *first;
+    ArenaChunk *cur;
+} Arena;
+
+typedef struct arenaMark {
+    ArenaChunk *chunk;
+    size_t used;
+} ArenaMark;
+
+#define ARENA_CHUNK_SIZE 65536
+
+static void initArena(Arena *a) {
+    a->first = NULL;
+    a->cur = NULL;
+}
+
+static void freeArena(Arena *a) {
+    ArenaChunk *c = a->first;
+    while (c) {
+        ArenaChunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    initArena(a);
+}
+
+static void *arenaAlloc(Arena *a, size_t len) {
+    len = (len + 15) & ~(size_t) 15;
+    if (a->cur && a->cur->size - a->cur->used >= len) {
+        void *p = a->cur->data + a->cur->used;
+        a->cur->used += len;
+        return p;
+    }
+
+    // Move on to the next spare chunk if it's big enough, otherwise
+    // slot a new one in ahead of it
+    ArenaChunk *next = a->cur ? a->cur->next : a->first;
+    if (!next || next->size < len) {
+        size_t size = len > ARENA_CHUNK_SIZE ? len : ARENA_CHUNK_SIZE;
+        ArenaChunk *c = (ArenaChunk *) malloc(sizeof(ArenaChunk) + size);
+        if (!c) exit(1);
+        rv_thread_stats.allocs++;
+        c->size = size;
+        c->next = next;
+        if (a->cur) a->cur->next = c;
+        else a->first = c;
+        next = c;
+    }
+    next->used = len;
+    a->cur = next;
+    return next->data;
+}
+
+static ArenaMark arenaMark(const Arena *a) {
+    ArenaMark m = { a->cur, a->cur ? a->cur->used : 0 };
+    return m;
+}
+
+// Free everything allocated since m was taken
+static void arenaRelease(Arena *a, ArenaMark m) {
+    a->cur = m.chunk;
+    if (a->cur) a->cur->used = m.used;
+}
+
+// A value's data. ptr points into the hive when the value is held in a
+// single cell, or in the vk itself, and into the caller's arena when
+// it had to be gathered from the segments of a db record.
+typedef struct valueData {
+    const unsigned char *ptr;
+    uint32_t len;
+} ValueData;
+
+// Gather the data of a value stored as a db record into arena. Only
+// values too big for one cell are stored that way, so the data is
+// always split over separate segment cells.
+static int getBigData(Hive *hive, const DB *db, uint32_t len, Arena *arena, ValueData *data) {
+    const uint32_t *segs = (const uint32_t *) getCell(hive, db->segments,
+        db->num_segments * sizeof(uint32_t));
+    if (!segs || (uint64_t) db->num_segments * DB_SEGMENT_SIZE < len)
+        return 0;
+
+    unsigned char *buf = (unsigned char *) arenaAlloc(arena, len);
+    uint32_t done = 0;
+    for (int i = 0; done < len; i++) {
+        uint32_t n = len - done < DB_SEGMENT_SIZE ? len - done : DB_SEGMENT_SIZE;
+        const unsigned char *seg = (const unsigned char *) getCell(hive, segs[i], n);
+        if (!seg) return 0;
+        memcpy(buf + done, seg, n);
+        done += n;
+    }
+    data->ptr = buf;
+    data->len = len;
+    return 1;
+}
+
+// Locate a value's data. Return value: 1 on success, 0 if the data
+// isn't all there.
+static int getValueData(Hive *hive, const VK *vk, Arena *arena, ValueData *data) {
+    uint32_t len = vk->data_len & ~VK_DATA_INLINE;
+
+    // Up to 4 bytes can be kept in the offset field itself
+    if (vk->data_len & VK_DATA_INLINE) {
+        if (len > sizeof(vk->data_off)) return 0;
+        data->ptr = (const unsigned char *) &vk->data_off;
+        data->len = len;
+        return 1;
+    }
+    if (len == 0) {
+        data->ptr = NULL;
+        data->len = 0;
+        return 1;
+    }
+
+    const HiveHeader *hdr = (const HiveHeader *) hive->base;
+    if (len > DB_SEGMENT_SIZE && hdr->version.minor > 3) {
+        const DB *db = (const DB *) getCell(hive, vk->data_off, sizeof(DB));
+        if (db && cellSignature(db) == SIG('d', 'b'))
+            return getBigData(hive, db, len, arena, data);
+    }
+
+    data->ptr = (const unsigned char *) getCell(hive, vk->data_off, len);
+    data->len = len;
+    return data->ptr != NULL;
+}
+
+#define WRITER_BUF_SIZE (1 << 20)
+
+void rv_initWriter(Writer *w, SinkFn sink, void *ctx) {
+    w->sink = sink;
+    w->sink_ctx = ctx;
+    w->len = 0;
+    w->cap = sink ? WRITER_BUF_SIZE : 4096;
+    w->buf = (char *) malloc(w->cap);
+    if (!w->buf) exit(1);
+}
+
+int rv_fdSinkWrite(void *ctx, const struct iovec *iov, int iovcnt) {
+    FdSink *s = (FdSink *) ctx;
+    struct iovec rest[64];
+
+    while (iovcnt > 0) {
+        int n = iovcnt < 64 ? iovcnt : 64;
+        memcpy(rest, iov, n * sizeof(struct iovec));
+        int i = 0;
+        while (i < n) {
+            ssize_t done = writev(s->fd, rest + i, n - i);
+            if (done < 0) {
+                if (errno == EINTR) continue;
+                perror("write");
+                return 0;
+            }
+            // Skip whatever was written, in case it was only partly
+            while (i < n && (size_t) done >= rest[i].iov_len) {
+                done -= rest[i].iov_len;
+                i++;
+            }
+            if (i < n) {
+                rest[i].iov_base = (char *) rest[i].iov_base + done;
+                rest[i].iov_len -= done;
+            }
+        }
+        iov += n;
+        iovcnt -= n;
+    }
+    return 1;
+}
+
+// Hand buffers to a writer's sink, timing it for --stats
+static void sinkBuffers(Writer *w, const struct iovec *iov, int iovcnt) {
+    uint64_t start = rv_collect_stats ? nowNs() : 0;
+    if (!w->sink(w->sink_ctx, iov, iovcnt)) exit(1);
+    if (rv_collect_stats) {
+        uint64_t ns = nowNs() - start;
+        rv_thread_stats.output_ns += ns;
+        if (rv_thread_stats.walking) rv_thread_stats.walk_output_ns += ns;
+    }
+}
+
+// Pass everything buffered so far to the sink
+void rv_flushWriter(Writer *w) {
+    if (!w->sink || !w->len) return;
+    struct iovec iov = { w->buf, w->len };
+    sinkBuffers(w, &iov, 1);
+    w->len = 0;
+}
+
+void rv_freeWriter(Writer *w) {
+    rv_flushWriter(w);
+    free(w->buf);
+    w->buf = NULL;
+    w->len = w->cap = 0;
+}
+
+// Make room for len more bytes
+static void reserveWriter(Writer *w, size_t len) {
+    if (w->cap - w->len >= len) return;
+    rv_flushWriter(w);
+    if (w->cap - w->len >= len) return;
+    while (w->cap - w->len < len) w->cap *= 2;
+    w->buf = (char *) realloc(w->buf, w->cap);
+    if (!w->buf) exit(1);
+    rv_thread_stats.allocs++;
+}
+
+// Write a batch of separate buffers, such as finished pieces of
+// output assembled elsewhere, in one go after what's buffered
+static void writeBuffers(Writer *w, const struct iovec *iov, int iovcnt) {
+    if (!w->sink) {
+        for (int i = 0; i < iovcnt; i++) {
+            reserveWriter(w, iov[i].iov_len);
+            memcpy(w->buf + w->len, iov[i].iov_base, iov[i].iov_len);
+            w->len += iov[i].iov_len;
+        }
+        return;
+    }
+    rv_flushWriter(w);
+    sinkBuffers(w, iov, iovcnt);
+}
+
+void rv_writeBytes(Writer *w, const void *p, size_t len) {
+    reserveWriter(w, len);
+    memcpy(w->buf + w->len, p, len);
+    w->len += len;
+}
+
+static void writeChar(Writer *w, char c) {
+    reserveWriter(w, 1);
+    w->buf[w->len++] = c;
+}
+
+void rv_writeStr(Writer *w, const char *s) {
+    rv_writeBytes(w, s, strlen(s));
+}
+
+static void writeIndent(Writer *w, int n) {
+    if (n <= 0) return;
+    reserveWriter(w, n);
+    memset(w->buf + w->len, ' ', n);
+    w->len += n;
+}
+
+// printf into the buffer, with no copy on the way
+void rv_writeFmt(Writer *w, const char *fmt, ...) {
+    va_list ap;
+    while (1) {
+        size_t room = w->cap - w->len;
+        va_start(ap, fmt);
+        int n = vsnprintf(w->buf + w->len, room, fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        if ((size_t) n < room) {
+            w->len += n;
+            return;
+        }
+        reserveWriter(w, n + 1);
+    }
+}
+
+// The writer for the main output, flushed on the way out so that
+// anything printed before a fatal error still appears ahead of it
+Writer rv_output;
+static FdSink output_sink = { 1, -1 };
+
+static void flushOutput(void) {
+    rv_flushWriter(&rv_output);
+}
+
+// Compressors that -o can feed, chosen by file name suffix
+static const char *compressors[][2] = {
+    { ".gz", "gzip" },
+    { ".zst", "zstd" },
+    { ".xz", "xz" },
+    { ".bz2", "bzip2" },
+};
+
+// Point the main output at path, or at stdout if path is NULL
+void rv_openOutput(const char *path) {
+    if (path) {
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror("open");
+            exit(1);
+        }
+        output_sink.fd = fd;
+
+        size_t len = strlen(path);
+        for (size_t i = 0; i < sizeof(compressors) / sizeof(compressors[0]); i++) {
+            size_t slen = strlen(compressors[i][0]);
+            if (len <= slen || strcmp(path + len - slen, compressors[i][0]))
+                continue;
+
+            // Run the compressor with the file as its stdout, and write
+            // to it through a pipe
+            int p[2];
+            if (pipe(p) < 0) {
+                perror("pipe");
+                exit(1);
+            }
+            pid_t pid = fork();
+            if (pid < 0) {
+                perror("fork");
+                exit(1);
+            }
+            if (pid == 0) {
+                dup2(p[0], 0);
+                dup2(fd, 1);
+                close(p[0]);
+                close(p[1]);
+                close(fd);
+                execlp(compressors[i][1], compressors[i][1], "-c", (char *) NULL);
+                perror(compressors[i][1]);
+                _exit(127);
+            }
+            close(p[0]);
+            close(fd);
+            output_sink.fd = p[1];
+            output_sink.child = pid;
+            break;
+        }
+    }
+    rv_initWriter(&rv_output, rv_fdSinkWrite, &output_sink);
+    atexit(flushOutput);
+}
+
+void rv_closeOutput(void) {
+    rv_freeWriter(&rv_output);
+    if (output_sink.fd != 1) close(output_sink.fd);
+    if (output_sink.child > 0) {
+        int status;
+        waitpid(output_sink.child, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+            printf("Fatal: output compressor failed\n");
+            exit(1);
+        }
+    }
+}
+
+// Key and value names are stored compressed, one Latin-1 byte per
+// character, when their flag is set, and as UTF-16LE otherwise. Either
+// way they're only turned into UTF-8 where they are printed or
+// compared, and the usual name, compressed and all ASCII, is used in
+// place without being converted at all. Like strnlen on compressed
+// names, decoding stops at a NUL.
+
+// UTF-8 takes at most twice the bytes of either form: 2 for a Latin-1
+// byte, 3 for a 2 byte UTF-16 unit and 4 for a surrogate pair
+#define UTF8_NAME_MAX(len) (2 * (size_t) (len))
+
+// The number of bytes at the start of p below 0x80
+static size_t asciiPrefix(const unsigned char *p, size_t len) {
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    for (; i + 32 <= len; i += 32) {
+        uint32_t high = (uint32_t) _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *) (p + i)));
+        if (high) return i + __builtin_ctz(high);
+    }
+#elif defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        uint32_t high = (uint32_t) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) (p + i)));
+        if (high) return i + __builtin_ctz(high);
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t high = vcgeq_u8(vld1q_u8(p + i), vdupq_n_u8(0x80));
+        uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(high), 4)), 0);
+        if (bits) return i + __builtin_ctzll(bits) / 4;
+    }
+#endif
+    while (i < len && p[i] < 0x80) i++;
+    return i;
+}
+
+static inline size_t putUtf8(uint32_t c, char *dst) {
+    if (c < 0x80) {
+        dst[0] = c;
+        return 1;
+    }
+    if (c < 0x800) {
+        dst[0] = 0xc0 | (c >> 6);
+        dst[1] = 0x80 | (c & 0x3f);
+        return 2;
+    }
+    if (c < 0x10000) {
+        dst[0] = 0xe0 | (c >> 12);
+        dst[1] = 0x80 | ((c >> 6) & 0x3f);
+        dst[2] = 0x80 | (c & 0x3f);
+        return 3;
+    }
+    dst[0] = 0xf0 | (c >> 18);
+    dst[1] = 0x80 | ((c >> 12) & 0x3f);
+    dst[2] = 0x80 | ((c >> 6) & 0x3f);
+    dst[3] = 0x80 | (c & 0x3f);
+    return 4;
+}
+
+// Convert len Latin-1 bytes to UTF-8 at dst. Return value: the
+// number of bytes written.
+static size_t latin1ToUtf8(const unsigned char *src, size_t len, char *dst) {
+    size_t i = 0, n = 0;
+
+    while (i < len) {
+        size_t run = asciiPrefix(src + i, len - i);
+        memcpy(dst + n, src + i, run);
+        i += run;
+        n += run;
+        if (i < len) n += putUtf8(src[i++], dst + n);
+    }
+    return n;
+}
+
+// Convert up to units UTF-16LE code units to UTF-8 at dst, stopping
+// at a NUL. Runs of ASCII go 8 units at a time; anything else, one
+// character at a time, with unpaired surrogates written as U+FFFD.
+// Return value: the number of bytes written.
+static size_t utf16ToUtf8(const unsigned char *src, size_t units, char *dst) {
+    size_t i = 0, n = 0;
+
+    while (i < units) {
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        while (i + 8 <= units) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (src + i * 2));
+            __m128i ascii = _mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16((short) 0xff80)), zero);
+            __m128i nul = _mm_cmpeq_epi16(v, zero);
+            if (_mm_movemask_epi8(_mm_andnot_si128(nul, ascii)) != 0xffff) break;
+            _mm_storel_epi64((__m128i *) (dst + n), _mm_packus_epi16(v, v));
+            i += 8;
+            n += 8;
+        }
+#elif defined(__ARM_NEON)
+        while (i + 8 <= units) {
+            uint16x8_t v = vreinterpretq_u16_u8(vld1q_u8(src + i * 2));
+            uint16x8_t bad = vorrq_u16(vtstq_u16(v, vdupq_n_u16(0xff80)), vceqq_u16(v, vdupq_n_u16(0)));
+            if (vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(bad)), 0)) break;
+            vst1_u8((uint8_t *) dst + n, vmovn_u16(v));
+            i += 8;
+            n += 8;
+        }
+#endif
+        if (i >= units) break;
+
+        uint32_t c = src[i * 2] | src[i * 2 + 1] << 8;
+        if (!c) break;
+        i++;
+        if (c >= 0xd800 && c < 0xe000) {
+            uint32_t low = i < units ? (uint32_t) (src[i * 2] | src[i * 2 + 1] << 8) : 0;
+            if (c < 0xdc00 && low >= 0xdc00 && low < 0xe000) {
+                c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                i++;
+            }
+            else {
+                c = 0xfffd;
+            }
+        }
+        n += putUtf8(c, dst + n);
+    }
+    return n;
+}
+
+// Convert a name of len bytes to UTF-8 at dst, which must have room
+// for UTF8_NAME_MAX(len) bytes. Return value: the length written.
+static size_t nameToUtf8(const char *name, size_t len, int compressed, char *dst) {
+    if (compressed)
+        return latin1ToUtf8((const unsigned char *) name, strnlen(name, len), dst);
+    return utf16ToUtf8((const unsigned char *) name, len / 2, dst);
+}
+
+// Return a name as UTF-8, with *out_len set to its length: the name
+// itself if it's compressed and all ASCII, otherwise a copy decoded
+// into arena
+static const char *decodeName(Arena *arena, const char *name, size_t len, int compressed,
+        size_t *out_len) {
+    if (compressed) {
+        len = strnlen(name, len);
+        if (asciiPrefix((const unsigned char *) name, len) == len) {
+            *out_len = len;
+            return name;
+        }
+    }
+    char *buf = (char *) arenaAlloc(arena, UTF8_NAME_MAX(len));
+    *out_len = nameToUtf8(name, len, compressed, buf);
+    return buf;
+}
+
+static const char *keyName(Arena *arena, const NK *key, size_t *len) {
+    return decodeName(arena, key->name, key->name_len, key->type & NK_COMP_NAME, len);
+}
+
+static const char *valueName(Arena *arena, const VK *vk, size_t *len) {
+    return decodeName(arena, vk->name, vk->name_len, vk->flags & VK_COMP_NAME, len);
+}
+
+// Write a name as UTF-8, decoding it straight into the buffer
+static void writeName(Writer *w, const char *name, size_t len, int compressed) {
+    reserveWriter(w, UTF8_NAME_MAX(len));
+    w->len += nameToUtf8(name, len, compressed, w->buf + w->len);
+}
+
+// Key names compare case-insensitively, in order of their uppercased
+// UTF-16 units, which is also the order Windows keeps subkey lists in.
+// Names are compared as they are stored, without decoding: runs of
+// ASCII in one byte forms are compared a vector at a time, and
+// anything else a unit at a time through an uppercase table.
+#define NAME_UTF8 0
+#define NAME_LATIN1 1
+#define NAME_UTF16 2
+
+// The table only has the simple one to one mappings, as Windows' does,
+// for the Latin, Greek, Cyrillic, Armenian and Glagolitic scripts and
+// the full width forms. Within a range, every step'th unit from first
+// is lowercase and delta away from its uppercase form.
+typedef struct upcaseRange {
+    uint16_t first;
+    uint16_t last;
+    int16_t delta;
+    uint16_t step;
+} UpcaseRange;
+
+static const UpcaseRange upcase_ranges[] = {
+    { 0x0061, 0x007a, -32, 1 }, { 0x00e0, 0x00f6, -32, 1 }, { 0x00f8, 0x00fe, -32, 1 },
+    { 0x00ff, 0x00ff, 121, 1 }, { 0x0101, 0x012f, -1, 2 }, { 0x0133, 0x0137, -1, 2 },
+    { 0x013a, 0x0148, -1, 2 }, { 0x014b, 0x0177, -1, 2 }, { 0x017a, 0x017e, -1, 2 },
+    { 0x01ce, 0x01dc, -1, 2 }, { 0x01df, 0x01ef, -1, 2 }, { 0x01f9, 0x021f, -1, 2 },
+    { 0x0223, 0x0233, -1, 2 }, { 0x03ac, 0x03ac, -38, 1 }, { 0x03ad, 0x03af, -37, 1 },
+    { 0x03b1, 0x03c1, -32, 1 }, { 0x03c2, 0x03c2, -31, 1 }, { 0x03c3, 0x03cb, -32, 1 },
+    { 0x03cc, 0x03cc, -64, 1 }, { 0x03cd, 0x03ce, -63, 1 }, { 0x0430, 0x044f, -32, 1 },
+    { 0x0450, 0x045f, -80, 1 }, { 0x0461, 0x0481, -1, 2 }, { 0x048b, 0x04bf, -1, 2 },
+    { 0x04c2, 0x04ce, -1, 2 }, { 0x04cf, 0x04cf, -15, 1 }, { 0x04d1, 0x052f, -1, 2 },
+    { 0x0561, 0x0586, -48, 1 }, { 0x1e01, 0x1e95, -1, 2 }, { 0x1ea1, 0x1eff, -1, 2 },
+    { 0x2170, 0x217f, -16, 1 }, { 0x24d0, 0x24e9, -26, 1 }, { 0x2c30, 0x2c5e, -48, 1 },
+    { 0xff41, 0xff5a, -32, 1 },
+};
+
+static uint16_t upcase_table[0x10000];
+static pthread_once_t upcase_once = PTHREAD_ONCE_INIT;
+
+static void fillUpcaseTable(void) {
+    for (uint32_t c = 0; c < 0x10000; c++) upcase_table[c] = c;
+    for (size_t i = 0; i < sizeof(upcase_ranges) / sizeof(upcase_ranges[0]); i++) {
+        const UpcaseRange *r = &upcase_ranges[i];
+        for (uint32_t c = r->first; c <= r->last; c += r->step)
+            upcase_table[c] = c + r->delta;
+    }
+}
+
+// The uppercase table, filled in the first time anything needs it
+static const uint16_t *upcaseTable(void) {
+    pthread_once(&upcase_once, fillUpcaseTable);
+    return upcase_table;
+}
+
+static inline int upcaseAscii(int c) {
+    return c - ((unsigned) (c - 'a') < 26 ? 32 : 0);
+}
+
+// Reads a name of any form as UTF-16 units. Bytes that aren't valid
+// UTF-8 are taken as Latin-1, and a NUL ends the stored forms.
+typedef struct nameReader {
+    const unsigned char *p;
+    size_t len;
+    size_t pos;
+    int form;
+    int pending;                // low surrogate still to come, or -1
+} NameReader;
+
+static inline void initNameReader(NameReader *r, const char *name, size_t len, int form) {
+    r->p = (const unsigned char *) name;
+    r->len = len;
+    r->pos = 0;
+    r->form = form;
+    r->pending = -1;
+}
+
+// Decode the UTF-8 character at s[*pos], moving *pos past it
+static uint32_t nextUtf8(const unsigned char *s, size_t len, size_t *pos) {
+    size_t i = *pos;
+    uint32_t c = s[i];
+    if (c < 0x80) {
+        *pos = i + 1;
+        return c;
+    }
+    int extra = c >= 0xf0 && c < 0xf5 ? 3 : c >= 0xe0 && c < 0xf0 ? 2 : c >= 0xc2 && c < 0xe0 ? 1 : 0;
+    uint32_t min = extra == 3 ? 0x10000 : extra == 2 ? 0x800 : 0x80;
+
+    if (extra && i + extra < len) {
+        uint32_t cp = c & (0x3f >> extra);
+        int k;
+        for (k = 1; k <= extra && (s[i + k] & 0xc0) == 0x80; k++)
+            cp = cp << 6 | (s[i + k] & 0x3f);
+        if (k > extra && cp >= min && cp < 0x110000 && (cp < 0xd800 || cp >= 0xe000)) {
+            *pos = i + extra + 1;
+            return cp;
+        }
+    }
+    *pos = i + 1;
+    return c;
+}
+
+// Return value: the next unit, or -1 at the end of the name
+static inline int nextNameUnit(NameReader *r) {
+    if (r->pending >= 0) {
+        int low = r->pending;
+        r->pending = -1;
+        return low;
+    }
+    if (r->form == NAME_UTF16) {
+        if (r->pos + 2 > r->len) return -1;
+        int unit = r->p[r->pos] | r->p[r->pos + 1] << 8;
+        r->pos += 2;
+        return unit ? unit : -1;
+    }
+    if (r->pos >= r->len) return -1;
+    if (r->form == NAME_LATIN1) {
+        int c = r->p[r->pos++];
+        return c ? c : -1;
+    }
+    uint32_t c = nextUtf8(r->p, r->len, &r->pos);
+    if (c < 0x10000) return c;
+    c -= 0x10000;
+    r->pending = 0xdc00 | (c & 0x3ff);
+    return 0xd800 | (c >> 10);
+}
+
+// Compare the first n bytes of a and b case-insensitively, for as long
+// as they're ASCII. Return value: the difference between the first
+// pair of characters that differ, or 0 with *pos set to how far the
+// comparison got: n, or the first byte that isn't ASCII.
+static int compareAscii(const unsigned char *a, const unsigned char *b, size_t n, size_t *pos) {
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    const __m256i below_a = _mm256_set1_epi8('a' - 1), above_z = _mm256_set1_epi8('z' + 1);
+    const __m256i case_bit = _mm256_set1_epi8(0x20);
+    for (; i + 32 <= n; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i));
+        if (_mm256_movemask_epi8(_mm256_or_si256(va, vb))) break;
+        va = _mm256_sub_epi8(va, _mm256_and_si256(case_bit, _mm256_and_si256(
+            _mm256_cmpgt_epi8(va, below_a), _mm256_cmpgt_epi8(above_z, va))));
+        vb = _mm256_sub_epi8(vb, _mm256_and_si256(case_bit, _mm256_and_si256(
+            _mm256_cmpgt_epi8(vb, below_a), _mm256_cmpgt_epi8(above_z, vb))));
+        uint32_t differ = ~(uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+        if (differ) {
+            i += __builtin_ctz(differ);
+            return upcaseAscii(a[i]) - upcaseAscii(b[i]);
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i below_a = _mm_set1_epi8('a' - 1), above_z = _mm_set1_epi8('z' + 1);
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+        if (_mm_movemask_epi8(_mm_or_si128(va, vb))) break;
+        va = _mm_sub_epi8(va, _mm_and_si128(case_bit, _mm_and_si128(
+            _mm_cmpgt_epi8(va, below_a), _mm_cmpgt_epi8(above_z, va))));
+        vb = _mm_sub_epi8(vb, _mm_and_si128(case_bit, _mm_and_si128(
+            _mm_cmpgt_epi8(vb, below_a), _mm_cmpgt_epi8(above_z, vb))));
+        uint32_t differ = ~(uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xffff;
+        if (differ) {
+            i += __builtin_ctz(differ);
+            return upcaseAscii(a[i]) - upcaseAscii(b[i]);
+        }
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t lower_a = vdupq_n_u8('a'), lower_z = vdupq_n_u8('z');
+    const uint8x16_t case_bit = vdupq_n_u8(0x20);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t va = vld1q_u8(a + i), vb = vld1q_u8(b + i);
+        uint8x16_t high = vcgeq_u8(vorrq_u8(va, vb), vdupq_n_u8(0x80));
+        if (vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(high), 4)), 0)) break;
+        va = vsubq_u8(va, vandq_u8(case_bit, vandq_u8(vcgeq_u8(va, lower_a), vcleq_u8(va, lower_z))));
+        vb = vsubq_u8(vb, vandq_u8(case_bit, vandq_u8(vcgeq_u8(vb, lower_a), vcleq_u8(vb, lower_z))));
+        uint8x16_t same = vceqq_u8(va, vb);
+        uint64_t differ = ~vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(same), 4)), 0);
+        if (differ) {
+            i += __builtin_ctzll(differ) / 4;
+            return upcaseAscii(a[i]) - upcaseAscii(b[i]);
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if ((a[i] | b[i]) >= 0x80) break;
+        int ca = upcaseAscii(a[i]), cb = upcaseAscii(b[i]);
+        if (ca != cb) return ca - cb;
+    }
+    *pos = i;
+    return 0;
+}
+
+// Compare two names, each in any of the NAME_ forms. Return value:
+// negative, 0 or positive, as for strcmp.
+static int compareNameForms(const char *a, size_t alen, int aform, const char *b, size_t blen, int bform) {
+    size_t start = 0;
+
+    // One byte forms agree on ASCII, so a common run of it can be
+    // skipped before either is decoded
+    if (aform != NAME_UTF16 && bform != NAME_UTF16) {
+        size_t n = alen < blen ? alen : blen;
+        int c = compareAscii((const unsigned char *) a, (const unsigned char *) b, n, &start);
+        if (c) return c;
+        if (start == n) return (alen > blen) - (alen < blen);
+    }
+
+    const uint16_t *up = upcaseTable();
+    NameReader ra, rb;
+    initNameReader(&ra, a + start, alen - start, aform);
+    initNameReader(&rb, b + start, blen - start, bform);
+    while (1) {
+        int ca = nextNameUnit(&ra), cb = nextNameUnit(&rb);
+        if (ca < 0 || cb < 0) return (ca >= 0) - (cb >= 0);
+        if (ca != cb && up[ca] != up[cb]) return up[ca] - up[cb];
+    }
+}
+
+static int compareNames(const char *a, size_t alen, const char *b, size_t blen) {
+    return compareNameForms(a, alen, NAME_UTF8, b, blen, NAME_UTF8);
+}
+
+// A key's or value's name as stored, for compareNameForms
+static inline int keyNameForm(const NK *key) {
+    return key->type & NK_COMP_NAME ? NAME_LATIN1 : NAME_UTF16;
+}
+
+static inline size_t keyNameLen(const NK *key) {
+    return key->type & NK_COMP_NAME ? strnlen(key->name, key->name_len) : key->name_len;
+}
+
+static inline int valueNameForm(const VK *vk) {
+    return vk->flags & VK_COMP_NAME ? NAME_LATIN1 : NAME_UTF16;
+}
+
+static inline size_t valueNameLen(const VK *vk) {
+    return vk->flags & VK_COMP_NAME ? strnlen(vk->name, vk->name_len) : vk->name_len;
+}
+
+#define WINDOWS_TICK 10000000
+#define SEC_TO_UNIX_EPOCH 11644473600LL
+
+static unsigned WindowsTickToUnixSeconds(uint64_t windowsTicks)
+{
+     return (unsigned)(windowsTicks / WINDOWS_TICK - SEC_TO_UNIX_EPOCH);
+}
+
+// Print an NT time in human-readable format
+void rv_printNTTime(const FILETIME *ft, Writer *out) {
+    uint64_t ticks = ((uint64_t)ft->dwHighDateTime << 32) | ft->dwLowDateTime;
+    time_t unix_time = WindowsTickToUnixSeconds(ticks);
+
+    //printf("Last modification time: %02d/%02d/%04d %02d:%02d:%02d +%d ms UTC\n",
+    //  s.wMonth, s.wDay, s.wYear, s.wHour, s.wMinute, s.wSecond, s.wMilliseconds);
+    char buf[32];
+    rv_writeFmt(out, "Last modification time: %s", ctime_r(&unix_time, buf));
+     
+    return;
+}
+
+// Print only the name for a node/key
+static void printNKName(const NK *nodeKey, int tabs, Writer *out) {
+    writeIndent(out, tabs);
+    writeName(out, nodeKey->name, nodeKey->name_len, nodeKey->type & NK_COMP_NAME);
+    writeChar(out, '\n');
+
+    return;
+}
+
+static const char *valueTypeNames[] = {
+    "REG_NONE", "REG_SZ", "REG_EXPAND_SZ", "REG_BINARY", "REG_DWORD",
+    "REG_DWORD_BIG_ENDIAN", "REG_LINK", "REG_MULTI_SZ", "REG_RESOURCE_LIST",
+    "REG_FULL_RESOURCE_DESCRIPTOR", "REG_RESOURCE_REQUIREMENTS_LIST", "REG_QWORD"
+};
+
+// Print a UTF-16 string value, up to its terminator, as ASCII
+static void printValueString(const unsigned char *data, uint32_t len, Writer *out) {
+    writeChar(out, '"');
+    for (uint32_t i = 0; i + 1 < len; i += 2) {
+        uint16_t c = data[i] | (data[i + 1] << 8);
+        if (c == 0) {
+            // REG_MULTI_SZ strings are separated by NULs
+            if (i + 3 < len && (data[i + 2] || data[i + 3])) {
+                rv_writeStr(out, "\", \"");
+                continue;
+            }
+            break;
+        }
+        if (i >= 512) {
+            rv_writeStr(out, "...");
+            break;
+        }
+        writeChar(out, c >= 0x20 && c < 0x7f ? c : '?');
+    }
+    writeChar(out, '"');
+}
+
+// Print a value's name, type and data
+static void printVK(const VK *vk, Hive *hive, Arena *arena, int tabs, Writer *out) {
+    ValueData data;
+
+    writeIndent(out, tabs);
+    if (vk->name_len)
+        writeName(out, vk->name, vk->name_len, vk->flags & VK_COMP_NAME);
+    else
+        rv_writeStr(out, "(default)");
+    if (vk->type < sizeof(valueTypeNames) / sizeof(valueTypeNames[0]))
+        rv_writeFmt(out, " (%s) =", valueTypeNames[vk->type]);
+    else
+        rv_writeFmt(out, " (type 0x%x) =", vk->type);
+
+    if (!getValueData(hive, vk, arena, &data)) {
+        rv_writeFmt(out, " <bad data at 0x%x>\n", vk->data_off);
+        return;
+    }
+
+    if ((vk->type == REG_DWORD || vk->type == REG_DWORD_BIG_ENDIAN) && data.len == 4) {
+        uint32_t v;
+        memcpy(&v, data.ptr, sizeof(v));
+        if (vk->type == REG_DWORD_BIG_ENDIAN)
+            v = (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+        rv_writeFmt(out, " 0x%08x\n", v);
+    }
+    else if (vk->type == REG_QWORD && data.len == 8) {
+        uint64_t v;
+        memcpy(&v, data.ptr, sizeof(v));
+        rv_writeFmt(out, " 0x%016llx\n", (unsigned long long) v);
+    }
+    else if (vk->type == REG_SZ || vk->type == REG_EXPAND_SZ ||
+        vk->type == REG_LINK || vk->type == REG_MULTI_SZ) {
+        writeChar(out, ' ');
+        printValueString(data.ptr, data.len, out);
+        writeChar(out, '\n');
+    }
+    else {
+        rv_writeFmt(out, " %u bytes", data.len);
+        for (uint32_t i = 0; i < data.len && i < 16; i++)
+            rv_writeFmt(out, "%s%02x", i ? " " : ": ", data.ptr[i]);
+        rv_writeFmt(out, "%s\n", data.len > 16 ? " ..." : "");
+    }
+}
+
+// A decoded subkey list, pointing into the hive. lh/lf entries are
+// HashRecs and li/ri entries are bare offsets; either way the offset
+// comes first, so entries are read with a stride. The entries of an
+// ri list are offsets to further lh/lf/li lists rather than to keys.
+// Kinds are numbered as in Stats.lists.
+#define LIST_LF 0
+#define LIST_LH 1
+#define LIST_LI 2
+#define LIST_RI 3
+
+typedef struct subkeyList {
+    int kind;
+    const unsigned char *entries;
+    int count;
+    int stride;
+    int indirect;
+} SubkeyList;
+
+// Decode the subkey list at off. Return value: 1 for success,
+// 0 if the cell isn't a subkey list, -1 if it is cut short.
+static int readSubkeyList(Hive *hive, uint32_t off, SubkeyList *list) {
+    const LH *lh = (const LH *) getCell(hive, off, sizeof(LH));
+
+    if (!lh) return -1;
+    switch (cellSignature(lh)) {
+    case SIG('l', 'f'): list->kind = LIST_LF; break;
+    case SIG('l', 'h'): list->kind = LIST_LH; break;
+    case SIG('l', 'i'): list->kind = LIST_LI; break;
+    case SIG('r', 'i'): list->kind = LIST_RI; break;
+    default: return 0;
+    }
+    if(lh->num_entries < 0) return -1;
+
+    list->stride = list->kind < LIST_LI ? sizeof(HashRec) : sizeof(uint32_t);
+    list->indirect = list->kind == LIST_RI;
+    list->count = lh->num_entries;
+    if (rv_collect_stats) rv_thread_stats.lists[list->kind]++;
+    list->entries = (const unsigned char *) getCell(hive, off,
+        sizeof(LH) + list->count * list->stride);
+    if (!list->entries) return -1;
+    list->entries += sizeof(LH);
+    return 1;
+}
+
+// Like readSubkeyList, but for lists the traversal can't do without
+static int decodeSubkeyList(Hive *hive, uint32_t off, SubkeyList *list) {
+    int ok = readSubkeyList(hive, off, list);
+    if (ok < 0) hiveError("Unexpected EOF while reading file.");
+    return ok;
+}
+
+// Offset of the i'th entry of a subkey list
+static uint32_t subkeyOffset(const SubkeyList *list, int i) {
+    uint32_t off;
+    memcpy(&off, list->entries + i * list->stride, sizeof(off));
+    return off;
+}
+
+// Does this key have a subkey list worth following?
+static int hasSubkeys(const NK *key) {
+    return key->num_subkeys != 0 && key->subkeys != 0 &&
+        key->subkeys != 0xFFFFFFFF;
+}
+
+// One level of an in-progress walk: a key and its subkey list, and,
+// if that is an ri list, the lh/lf/li list currently being walked.
+typedef struct walkFrame {
+    const NK *key;
+    SubkeyList list;
+    SubkeyList leaf;
+    int pos;
+    int leaf_pos;
+} WalkFrame;
+
+// Called for each entry of a subkey list before the key it points to
+// is read, with the level the key would be visited at. Returning 0
+// skips the key and its subtree without touching its cell.
+typedef int (*SubkeyFilter)(const SubkeyList *list, int i, int level, void *ctx);
+
+// Explicit stack for walkSubTree. It only grows, so one walker can
+// be reused for any number of walks. Warnings about the structures
+// walked go to out, unless it is NULL.
+typedef struct walker {
+    WalkFrame *frames;
+    int cap;
+    Writer *out;
+    SubkeyFilter filter;        // NULL to visit every subkey
+    void *filter_ctx;
+} Walker;
+
+static void initWalker(Walker *w, Writer *out) {
+    w->frames = NULL;
+    w->cap = 0;
+    w->out = out;
+    w->filter = NULL;
+    w->filter_ctx = NULL;
+}
+
+static void freeWalker(Walker *w) {
+    free(w->frames);
+    w->frames = NULL;
+    w->cap = 0;
+}
+
+#define WALK_DESCEND 0
+#define WALK_SKIP 1
+
+// Called for every key in a walk, parents before children. Returning
+// WALK_SKIP leaves the key's subkeys unvisited.
+typedef int (*KeyVisitor)(Hive *hive, const NK *key, int level, void *ctx);
+
+// Start a frame at the first entry of the subkey list it holds
+static void resetFrame(WalkFrame *f) {
+    f->pos = 0;
+    f->leaf_pos = 0;
+    if(f->list.indirect) {
+        f->leaf.count = 0;
+    }
+    else {
+        f->leaf = f->list;
+        f->pos = f->list.count;
+    }
+}
+
+// Set up a frame to walk the subkeys of key. Return value: 1, or 0
+// after hiveError if the list can't be read.
+static int openFrame(Hive *hive, const NK *key, WalkFrame *f, Writer *out) {
+    int ok = decodeSubkeyList(hive, key->subkeys, &f->list);
+    if(!ok) hiveError("Fatal: encountered unknown subkey type");
+    if(ok <= 0) return 0;
+    f->key = key;
+    resetFrame(f);
+    if(out && !f->list.indirect && key->num_subkeys != f->list.count) {
+        rv_writeFmt(out, "WARN: number of subkeys does not match, %d != %d\n",
+            key->num_subkeys, f->list.count);
+    }
+    return 1;
+}
+
+// Advance a frame to its next subkey. Return value: 1 if there was
+// one (its offset is stored in off), 0 if the list is exhausted, -1
+// if an ri list points at something other than a leaf list.
+static int stepFrame(Hive *hive, WalkFrame *f, uint32_t *off) {
+    while(f->leaf_pos >= f->leaf.count) {
+        if(f->pos >= f->list.count) return 0;
+        if(readSubkeyList(hive, subkeyOffset(&f->list, f->pos), &f->leaf) != 1 ||
+            f->leaf.indirect) {
+            return -1;
+        }
+        f->pos++;
+        f->leaf_pos = 0;
+    }
+    *off = subkeyOffset(&f->leaf, f->leaf_pos++);
+    return 1;
+}
+
+// Like stepFrame, for walks that can't go on past a bad list: -1 is
+// only returned after hiveError.
+static int nextSubkey(Hive *hive, WalkFrame *f, uint32_t *off) {
+    int ok = stepFrame(hive, f, off);
+    if(ok < 0) hiveError("Fatal: encountered unknown subentry of ri list");
+    return ok;
+}
+
+// Windows doesn't let keys nest any deeper than this
+#define KEY_MAX_DEPTH 512
+
+// The key at off in the list of the last of depth frames, which would
+// be visited at level. A list that points back up the tree would have
+// a walk go round for ever, so the key mustn't be one of the frames'
+// keys, and mustn't be deeper than Windows allows. Return value: the
+// key, or NULL after hiveError.
+static const NK *needSubkey(Hive *hive, const WalkFrame *frames, int depth, uint32_t off, int level) {
+    const NK *key = needNK(hive, off);
+
+    if(!key) return NULL;
+    for(int i = 0; i < depth; i++) {
+        if(frames[i].key == key) {
+            hiveError("Fatal: key at 0x%x is listed under its own subkey 0x%x",
+                off, cellOffset(hive, frames[depth - 1].key));
+            return NULL;
+        }
+    }
+    if(level >= KEY_MAX_DEPTH) {
+        hiveError("Fatal: keys nested more than %d deep", KEY_MAX_DEPTH);
+        return NULL;
+    }
+    return key;
+}
+
+// Ask for the pages from first to last (page offsets in the file) to
+// be read in the background
+static void prefetchPages(Hive *hive, size_t first, size_t last, size_t page) {
+    posix_madvise((void *) (hive->base + first), last - first + page, POSIX_MADV_WILLNEED);
+    if (rv_collect_stats) rv_thread_stats.prefetches++;
+}
+
+// Start reading the cells a subkey list points to, the entries the
+// filter would skip aside, before the walk gets to any of them. On
+// storage where each read waits milliseconds for the one before it,
+// as over NFS, the reads for a whole list then overlap. Neighbouring
+// pages are asked for together, to keep down the number of calls.
+static void prefetchSubkeys(Walker *w, Hive *hive, const SubkeyList *list, int level) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t first = 0, last = 0;
+    int pending = 0;
+
+    for (int i = 0; i < list->count; i++) {
+        if (!list->indirect && w->filter && !w->filter(list, i, level, w->filter_ctx))
+            continue;
+        size_t start = convOff(subkeyOffset(list, i));
+        if (start < 0x1000 || start >= hive->size) continue;
+        size_t end = start + (list->indirect ? sizeof(LH) : sizeof(NK)) - 1;
+        if (end >= hive->size) end = hive->size - 1;
+        start &= ~(page - 1);
+        end &= ~(page - 1);
+        if (pending && start >= first && start <= last + page) {
+            if (end > last) last = end;
+            continue;
+        }
+        if (pending) prefetchPages(hive, first, last, page);
+        first = start;
+        last = end;
+        pending = 1;
+    }
+    if (pending) prefetchPages(hive, first, last, page);
+}
+
+static inline void countKey(const NK *key, int level) {
+    Stats *s = &rv_thread_stats;
+    uint32_t n = key->num_subkeys > 0 ? key->num_subkeys : 0;
+    int bucket = n ? 32 - __builtin_clz(n) : 0;
+
+    s->keys++;
+    s->fanout[bucket < FANOUT_BUCKETS ? bucket : FANOUT_BUCKETS - 1]++;
+    if ((uint32_t) level > s->max_depth) s->max_depth = level;
+}
+
+// Visit a key and everything below it in depth-first order, without
+// recursing: each level of nesting costs one WalkFrame on w's stack.
+static void walkSubTree(Walker *w, Hive *hive, const NK *root, int level,
+        KeyVisitor visit, void *ctx) {
+    const NK *key = root;
+    int depth = 0;
+    uint32_t off;
+    uint64_t start = 0;
+
+    if (rv_collect_stats) {
+        start = nowNs();
+        rv_thread_stats.walking++;
+    }
+    while(1) {
+        if (rv_collect_stats) countKey(key, level + depth);
+        if(visit(hive, key, level + depth, ctx) == WALK_DESCEND &&
+            hasSubkeys(key)) {
+            if(depth == w->cap) {
+                w->cap = w->cap ? w->cap * 2 : 16;
+                w->frames = (WalkFrame *) realloc(w->frames, w->cap * sizeof(WalkFrame));
+                if (!w->frames) exit(1);
+                rv_thread_stats.allocs++;
+            }
+            if(!openFrame(hive, key, &w->frames[depth], w->out)) break;
+            depth++;
+            if (rv_prefetch_cells)
+                prefetchSubkeys(w, hive, &w->frames[depth - 1].list, level + depth);
+        }
+        while(depth > 0) {
+            WalkFrame *f = &w->frames[depth - 1];
+            int ok = nextSubkey(hive, f, &off);
+            if(ok < 0) {
+                depth = 0;
+                break;
+            }
+            if(!ok) {
+                depth--;
+                continue;
+            }
+            // Just moved on to the next leaf of an ri list
+            if (rv_prefetch_cells && f->list.indirect && f->leaf_pos == 1)
+                prefetchSubkeys(w, hive, &f->leaf, level + depth);
+            if(!w->filter ||
+                w->filter(&f->leaf, f->leaf_pos - 1, level + depth, w->filter_ctx)) {
+                break;
+            }
+        }
+        if(depth == 0) break;
+        if(!(key = needSubkey(hive, w->frames, depth, off, level + depth))) break;
+    }
+    if (rv_collect_stats) {
+        rv_thread_stats.walk_ns += nowNs() - start;
+        rv_thread_stats.walking--;
+    }
+}
+
+// Security descriptors are summarised in SDDL form, with SIDs always
+// written out in full: O:owner G:group D:flags(ace)(ace)...
+#define SE_DACL_PRESENT 0x0004
+#define SE_DACL_AUTO_INHERITED 0x0400
+#define SE_DACL_PROTECTED 0x1000
+
+typedef struct securityDescriptor {
+    unsigned char revision;
+    unsigned char u1;
+    uint16_t control;
+    uint32_t owner;         // offsets from the start of the descriptor
+    uint32_t group;
+    uint32_t sacl;
+    uint32_t dacl;
+} SecurityDescriptor;
+
+typedef struct acl {
+    unsigned char revision;
+    unsigned char u1;
+    uint16_t size;
+    uint16_t num_aces;
+    uint16_t u2;
+} ACL;
+
+typedef struct aceHeader {
+    unsigned char type;
+    unsigned char flags;
+    uint16_t size;
+} AceHeader;
+
+#define ACE_ALLOWED 0
+#define ACE_DENIED 1
+
+// Append the SID at off in a descriptor of len bytes, S-1-5-21-...
+// Return value: 1 on success, 0 if it doesn't fit.
+static int writeSid(Writer *out, const unsigned char *sd, uint32_t len, uint32_t off) {
+    if (off < sizeof(SecurityDescriptor) || off > len || len - off < 8) return 0;
+    const unsigned char *sid = sd + off;
+    int count = sid[1];
+    if (count > 15 || len - off - 8 < (uint32_t) count * 4) return 0;
+
+    uint64_t authority = 0;
+    for (int i = 2; i < 8; i++) authority = authority << 8 | sid[i];
+    if (authority >> 32) rv_writeFmt(out, "S-%u-0x%012llx", sid[0], (unsigned long long) authority);
+    else rv_writeFmt(out, "S-%u-%llu", sid[0], (unsigned long long) authority);
+    for (int i = 0; i < count; i++) {
+        uint32_t sub;
+        memcpy(&sub, sid + 8 + i * 4, sizeof(sub));
+        rv_writeFmt(out, "-%u", sub);
+    }
+    return 1;
+}
+
+// Append the summary of a self-relative security descriptor
+static int writeDescriptor(Writer *out, const unsigned char *sd, uint32_t len) {
+    SecurityDescriptor hdr;
+    static const char *const ace_flags[] = { "OI", "CI", "NP", "IO", "ID" };
+
+    if (len < sizeof(hdr)) return 0;
+    memcpy(&hdr, sd, sizeof(hdr));
+    if (hdr.owner) {
+        rv_writeStr(out, "O:");
+        if (!writeSid(out, sd, len, hdr.owner)) return 0;
+    }
+    if (hdr.group) {
+        rv_writeStr(out, "G:");
+        if (!writeSid(out, sd, len, hdr.group)) return 0;
+    }
+
+    rv_writeStr(out, "D:");
+    if (!(hdr.control & SE_DACL_PRESENT) || !hdr.dacl) {
+        rv_writeStr(out, "NO_ACCESS_CONTROL");
+        return 1;
+    }
+    if (hdr.control & SE_DACL_PROTECTED) writeChar(out, 'P');
+    if (hdr.control & SE_DACL_AUTO_INHERITED) rv_writeStr(out, "AI");
+
+    ACL acl;
+    if (hdr.dacl > len || len - hdr.dacl < sizeof(acl)) return 0;
+    memcpy(&acl, sd + hdr.dacl, sizeof(acl));
+    if (acl.size > len - hdr.dacl) return 0;
+
+    uint32_t pos = sizeof(acl);
+    for (int i = 0; i < acl.num_aces; i++) {
+        AceHeader ace;
+        uint32_t mask;
+        if (acl.size - pos < sizeof(ace) + sizeof(mask)) return 0;
+        memcpy(&ace, sd + hdr.dacl + pos, sizeof(ace));
+        if (ace.size < sizeof(ace) + sizeof(mask) || ace.size > acl.size - pos) return 0;
+        memcpy(&mask, sd + hdr.dacl + pos + sizeof(ace), sizeof(mask));
+
+        writeChar(out, '(');
+        if (ace.type == ACE_ALLOWED) writeChar(out, 'A');
+        else if (ace.type == ACE_DENIED) writeChar(out, 'D');
+        else rv_writeFmt(out, "0x%x", ace.type);
+        writeChar(out, ';');
+        for (int f = 0; f < 5; f++) {
+            if (ace.flags & (1 << f)) rv_writeStr(out, ace_flags[f]);
+        }
+        rv_writeFmt(out, ";0x%x;;;", mask);
+        // Only the simple ACE types end in a SID
+        if (ace.type == ACE_ALLOWED || ace.type == ACE_DENIED) {
+            uint32_t sid = hdr.dacl + pos + sizeof(ace) + sizeof(mask);
+            if (!writeSid(out, sd, sid + ace.size - sizeof(ace) - sizeof(mask), sid))
+                return 0;
+        }
+        writeChar(out, ')');
+        pos += ace.size;
+    }
+    return 1;
+}
+
+// Decoded descriptors, by where their sk cell is in memory, so that
+// one cache can serve any number of hives. A hive has a few hundred sk
+// cells shared by all its keys, so each is summarised once and the
+// text handed out from then on. Each printing thread has its own.
+typedef struct skSlot {
+    uintptr_t cell;         // 0 for an empty slot
+    uint32_t start;         // the summary, in text
+    uint32_t len;
+} SkSlot;
+
+typedef struct skCache {
+    SkSlot *slots;
+    uint32_t nslots;
+    uint32_t count;
+    Writer text;
+} SkCache;
+
+static void initSkCache(SkCache *c) {
+    c->slots = NULL;
+    c->nslots = 0;
+    c->count = 0;
+    rv_initWriter(&c->text, NULL, NULL);
+}
+
+static void freeSkCache(SkCache *c) {
+    free(c->slots);
+    rv_freeWriter(&c->text);
+}
+
+static inline uint32_t skSlot(const SkCache *c, uintptr_t cell) {
+    return ((uint32_t) (cell / 8) * 2654435761u) & (c->nslots - 1);
+}
+
+static void growSkCache(SkCache *c) {
+    SkSlot *old = c->slots;
+    uint32_t old_n = c->nslots;
+
+    c->nslots = old_n ? old_n * 2 : 256;
+    c->slots = (SkSlot *) malloc(c->nslots * sizeof(SkSlot));
+    if (!c->slots) exit(1);
+    memset(c->slots, 0, c->nslots * sizeof(SkSlot));
+    for (uint32_t i = 0; i < old_n; i++) {
+        if (!old[i].cell) continue;
+        uint32_t s = skSlot(c, old[i].cell);
+        while (c->slots[s].cell) s = (s + 1) & (c->nslots - 1);
+        c->slots[s] = old[i];
+    }
+    free(old);
+}
+
+// The summary of the descriptor in the sk cell at off, decoding it the
+// first time it is asked for. *len is set to its length.
+static const char *getSecurity(SkCache *c, Hive *hive, uint32_t off, uint32_t *len) {
+    if (c->count * 2 >= c->nslots) growSkCache(c);
+
+    uintptr_t cell = (uintptr_t) hive->base + off;
+    uint32_t s = skSlot(c, cell);
+    while (c->slots[s].cell) {
+        if (c->slots[s].cell == cell) {
+            *len = c->slots[s].len;
+            return c->text.buf + c->slots[s].start;
+        }
+        s = (s + 1) & (c->nslots - 1);
+    }
+
+    size_t start = c->text.len;
+    const SK *sk = (const SK *) getCell(hive, off, offsetof(SK, descriptor));
+    if (!sk || cellSignature(sk) != SIG('s', 'k') ||
+        !getCell(hive, off, offsetof(SK, descriptor) + sk->descriptor_len) ||
+        !writeDescriptor(&c->text, sk->descriptor, sk->descriptor_len)) {
+        c->text.len = start;
+        rv_writeFmt(&c->text, "<bad sk cell at 0x%x>", off);
+    }
+    c->slots[s].cell = cell;
+    c->slots[s].start = start;
+    c->slots[s].len = c->text.len - start;
+    c->count++;
+    *len = c->slots[s].len;
+    return c->text.buf + start;
+}
+
+// Where and how keys are printed. Each thread has its own, along
+// with an arena for anything needed only while printing one key.
+typedef struct printer {
+    Writer *out;
+    const PrintOptions *opts;
+    Arena arena;
+    SkCache security;
+} Printer;
+
+static void initPrinter(Printer *p, Writer *out, const PrintOptions *opts) {
+    p->out = out;
+    p->opts = opts;
+    initArena(&p->arena);
+    initSkCache(&p->security);
+}
+
+static void freePrinter(Printer *p) {
+    freeArena(&p->arena);
+    freeSkCache(&p->security);
+}
+
+// Print a key's security descriptor and values, if they were asked
+// for, indented by tabs
+static void printKeyValues(Printer *p, Hive *hive, const NK *key, int tabs) {
+    if (p->opts->security && key->security != 0xFFFFFFFF) {
+        uint32_t len;
+        const char *sd = getSecurity(&p->security, hive, key->security, &len);
+        writeIndent(p->out, tabs);
+        rv_writeStr(p->out, "(security) ");
+        rv_writeBytes(p->out, sd, len);
+        writeChar(p->out, '\n');
+    }
+    if (!p->opts->values) return;
+
+    ArenaMark mark = arenaMark(&p->arena);
+    const uint32_t *values = getValueList(hive, key);
+    for (int i = 0; values && i < key->num_values; i++) {
+        const VK *vk = getVK(hive, values[i]);
+        if (!vk) {
+            rv_writeFmt(p->out, "WARN: bad vk cell at 0x%x\n", values[i]);
+            continue;
+        }
+        printVK(vk, hive, &p->arena, tabs, p->out);
+        arenaRelease(&p->arena, mark);
+    }
+}
+
+// Print a key's name, and whatever else was asked for
+static void printKey(Printer *p, Hive *hive, const NK *key, int level) {
+    printNKName(key, level, p->out);
+    printKeyValues(p, hive, key, level + 1);
+}
+
+static int printKeyVisitor(Hive *hive, const NK *key, int level, void *ctx) {
+    printKey((Printer *) ctx, hive, key, level);
+    return WALK_DESCEND;
+}
+
+// Print a node and its subtree
+void rv_printSubTree(const NK *root, Hive *hive, int level, const PrintOptions *opts,
+        Writer *out) {
+    Walker w;
+    Printer p;
+    initWalker(&w, out);
+    initPrinter(&p, out, opts);
+    walkSubTree(&w, hive, root, level, printKeyVisitor, &p);
+    freePrinter(&p);
+    freeWalker(&w);
+}
+
+// For parallel printing the tree is cut, in output order, into
+// segments: either a whole subtree, or just the line(s) for a key
+// whose subkeys were split off into segments of their own. Workers
+// print segments into memory and the main thread writes them out in
+// order, so the result is byte-for-byte what rv_printSubTree prints.
+// Each segment names its hive, so one set of workers can print
+// several hives' trees together (see rv_printMountTree).
+typedef struct segment {
+    Hive *hive;
+    const NK *key;          // NULL for lines printed up front
+    int level;
+    int whole;
+    Writer out;
+    int done;
+} Segment;
+
+// The range of segments a worker has yet to print. Idle workers
+// steal the back half of someone else's range.
+typedef struct segmentQueue {
+    int lo;
+    int hi;
+    pthread_mutex_t lock;
+} SegmentQueue;
+
+typedef struct parallelWalk {
+    const PrintOptions *opts;
+    Segment *segs;
+    int nsegs;
+    SegmentQueue *queues;
+    int nthreads;
+    int next;               // segment the writer is waiting on
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ParallelWalk;
+
+typedef struct segmentWorkerArg {
+    ParallelWalk *pw;
+    int id;
+} SegmentWorkerArg;
+
+static void initParallelWalk(ParallelWalk *pw, const PrintOptions *opts) {
+    memset(pw, 0, sizeof(*pw));
+    pw->opts = opts;
+}
+
+// Make room for n segments at index i, moving the ones from i on up.
+// Return value: the first of the new segments.
+static Segment *insertSegments(ParallelWalk *pw, int i, int n) {
+    pw->segs = (Segment *) realloc(pw->segs, (pw->nsegs + n) * sizeof(Segment));
+    if (!pw->segs) exit(1);
+    memmove(pw->segs + i + n, pw->segs + i, (pw->nsegs - i) * sizeof(Segment));
+    pw->nsegs += n;
+    return &pw->segs[i];
+}
+
+// Add a segment for key and its whole subtree at the end
+static void addWholeSegment(ParallelWalk *pw, Hive *hive, const NK *key, int level) {
+    Segment *s = insertSegments(pw, pw->nsegs, 1);
+    s->hive = hive;
+    s->key = key;
+    s->level = level;
+    s->whole = 1;
+    s->done = 0;
+}
+
+// Add a segment holding a single line of text, indented by level, at
+// the end. Return value: the segment, so more can be written to it.
+static Segment *addLineSegment(ParallelWalk *pw, const char *text, size_t len, int level) {
+    Segment *s = insertSegments(pw, pw->nsegs, 1);
+    s->hive = NULL;
+    s->key = NULL;
+    s->level = level;
+    s->whole = 0;
+    s->done = 1;
+    rv_initWriter(&s->out, NULL, NULL);
+    writeIndent(&s->out, level);
+    rv_writeBytes(&s->out, text, len);
+    writeChar(&s->out, '\n');
+    return s;
+}
+
+// Replace whole-subtree segment i by the key's own line(s) and one
+// segment per subkey. The key is printed as name, if that isn't NULL,
+// instead of under its own name.
+static void expandSegment(ParallelWalk *pw, int i, const char *name, size_t len) {
+    Segment *s = &pw->segs[i];
+    Hive *hive = s->hive;
+    WalkFrame f;
+    uint32_t off;
+    Printer p;
+    rv_initWriter(&s->out, NULL, NULL);
+    initPrinter(&p, &s->out, pw->opts);
+    if (rv_collect_stats) countKey(s->key, s->level);
+    if (name) {
+        writeIndent(&s->out, s->level);
+        rv_writeBytes(&s->out, name, len);
+        writeChar(&s->out, '\n');
+        printKeyValues(&p, hive, s->key, s->level + 1);
+    }
+    else {
+        printKey(&p, hive, s->key, s->level);
+    }
+    freePrinter(&p);
+    s->whole = 0;
+    s->done = 1;
+    if (!hasSubkeys(s->key) || !openFrame(hive, s->key, &f, &s->out)) return;
+
+    // Frames are plain views into the hive, so a copy rewinds the list
+    WalkFrame start = f;
+    int n = 0, ok;
+    int level = s->level + 1;
+    while ((ok = nextSubkey(hive, &f, &off)) > 0) {
+        if (!needSubkey(hive, &f, 1, off, level)) return;
+        n++;
+    }
+    if (ok < 0) return;
+    s = insertSegments(pw, i + 1, n);
+
+    for (int k = 0; k < n && nextSubkey(hive, &start, &off) > 0; k++) {
+        s[k].hive = hive;
+        s[k].key = getNK(hive, off);
+        s[k].level = level;
+        s[k].whole = 1;
+        s[k].done = 0;
+    }
+}
+
+// Split the whole-subtree segment with the most subkeys. Return
+// value: 1 if a segment was split, 0 if there is nothing left to split.
+static int splitSegment(ParallelWalk *pw) {
+    int best = -1;
+    for (int i = 0; i < pw->nsegs; i++) {
+        const NK *key = pw->segs[i].key;
+        if (pw->segs[i].whole && hasSubkeys(key) &&
+            (best < 0 || key->num_subkeys > pw->segs[best].key->num_subkeys)) {
+            best = i;
+        }
+    }
+    if (best < 0) return 0;
+    expandSegment(pw, best, NULL, 0);
+    return 1;
+}
+
+// Pick the next segment for worker id to print, stealing from the
+// other workers once its own range runs dry. Return value: index of
+// the segment, or -1 if there is no work left anywhere.
+static int takeSegment(ParallelWalk *pw, int id) {
+    SegmentQueue *q = &pw->queues[id];
+    int i = -1;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->lo < q->hi) i = q->lo++;
+    pthread_mutex_unlock(&q->lock);
+    if (i >= 0) return i;
+
+    for (int k = 1; k < pw->nthreads; k++) {
+        SegmentQueue *v = &pw->queues[(id + k) % pw->nthreads];
+        int lo = 0, hi = 0;
+        pthread_mutex_lock(&v->lock);
+        if (v->lo < v->hi) {
+            hi = v->hi;
+            lo = v->hi - (v->hi - v->lo + 1) / 2;
+            v->hi = lo;
+        }
+        pthread_mutex_unlock(&v->lock);
+        if (lo < hi) {
+            pthread_mutex_lock(&q->lock);
+            q->lo = lo + 1;
+            q->hi = hi;
+            pthread_mutex_unlock(&q->lock);
+            return lo;
+        }
+    }
+    return -1;
+}
+
+static void *segmentWorker(void *arg) {
+    ParallelWalk *pw = ((SegmentWorkerArg *) arg)->pw;
+    int id = ((SegmentWorkerArg *) arg)->id;
+    Walker w;
+    Printer p;
+    int i;
+
+    initWalker(&w, NULL);
+    initPrinter(&p, NULL, pw->opts);
+    while ((i = takeSegment(pw, id)) >= 0) {
+        Segment *s = &pw->segs[i];
+        if (s->done) continue;
+
+        rv_initWriter(&s->out, NULL, NULL);
+        w.out = &s->out;
+        p.out = &s->out;
+        walkSubTree(&w, s->hive, s->key, s->level, printKeyVisitor, &p);
+
+        pthread_mutex_lock(&pw->lock);
+        s->done = 1;
+        if (pw->next == i) pthread_cond_signal(&pw->cond);
+        pthread_mutex_unlock(&pw->lock);
+    }
+    freePrinter(&p);
+    freeWalker(&w);
+    rv_mergeStats();
+    return NULL;
+}
+
+// Print every segment of pw to out, in order, then free them. With
+// more than one thread the segments are first split up further, so
+// there are enough to keep them all busy.
+static void runSegments(ParallelWalk *pw, int nthreads, Writer *out) {
+    if (nthreads < 2) {
+        Walker w;
+        Printer p;
+        initWalker(&w, out);
+        initPrinter(&p, out, pw->opts);
+        for (int i = 0; i < pw->nsegs; i++) {
+            Segment *s = &pw->segs[i];
+            if (s->done) {
+                rv_writeBytes(out, s->out.buf, s->out.len);
+                rv_freeWriter(&s->out);
+            }
+            else {
+                walkSubTree(&w, s->hive, s->key, s->level, printKeyVisitor, &p);
+            }
+        }
+        freePrinter(&p);
+        freeWalker(&w);
+        free(pw->segs);
+        return;
+    }
+
+    // A few segments per thread leaves room for stealing to even out
+    // subtrees of very different sizes
+    pw->nthreads = nthreads;
+    while (pw->nsegs < nthreads * 16 && splitSegment(pw));
+
+    pw->queues = (SegmentQueue *) malloc(nthreads * sizeof(SegmentQueue));
+    pthread_t *threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+    SegmentWorkerArg *args = (SegmentWorkerArg *) malloc(nthreads * sizeof(SegmentWorkerArg));
+    if (!pw->queues || !threads || !args) exit(1);
+    pw->next = 0;
+    pthread_mutex_init(&pw->lock, NULL);
+    pthread_cond_init(&pw->cond, NULL);
+    for (int t = 0; t < nthreads; t++) {
+        pw->queues[t].lo = (int64_t) pw->nsegs * t / nthreads;
+        pw->queues[t].hi = (int64_t) pw->nsegs * (t + 1) / nthreads;
+        pthread_mutex_init(&pw->queues[t].lock, NULL);
+    }
+    for (int t = 0; t < nthreads; t++) {
+        args[t].pw = pw;
+        args[t].id = t;
+        if (pthread_create(&threads[t], NULL, segmentWorker, &args[t])) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    // Write segments out in tree order as they complete, taking as
+    // many finished ones at a time as there are
+    struct iovec iov[64];
+    for (int i = 0; i < pw->nsegs; ) {
+        int n = 0;
+        pthread_mutex_lock(&pw->lock);
+        pw->next = i;
+        while (!pw->segs[i].done) pthread_cond_wait(&pw->cond, &pw->lock);
+        while (i + n < pw->nsegs && n < 64 && pw->segs[i + n].done) n++;
+        pthread_mutex_unlock(&pw->lock);
+
+        for (int k = 0; k < n; k++) {
+            iov[k].iov_base = pw->segs[i + k].out.buf;
+            iov[k].iov_len = pw->segs[i + k].out.len;
+        }
+        writeBuffers(out, iov, n);
+        for (int k = 0; k < n; k++) {
+            rv_freeWriter(&pw->segs[i + k].out);
+        }
+        i += n;
+    }
+
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    for (int t = 0; t < nthreads; t++) {
+        pthread_mutex_destroy(&pw->queues[t].lock);
+    }
+    pthread_mutex_destroy(&pw->lock);
+    pthread_cond_destroy(&pw->cond);
+    free(args);
+    free(threads);
+    free(pw->queues);
+    free(pw->segs);
+}
+
+// Print a node and its subtree using nthreads worker threads
+void rv_printSubTreeParallel(const NK *root, Hive *hive, int level, int nthreads,
+        const PrintOptions *opts, Writer *out) {
+    ParallelWalk pw;
+
+    initParallelWalk(&pw, opts);
+    addWholeSegment(&pw, hive, root, level);
+    runSegments(&pw, nthreads, out);
+}
+
+// Full key paths for JSON output. The path is extended by one name
+// as the walk goes down a level and cut back when it comes up, so it
+// is never rebuilt from scratch. It is kept already escaped for JSON.
+typedef struct pathStack {
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t base;            // length of the part above the walk's top
+    size_t *ends;           // end of the path at each level
+    int levels;
+    int raw;                // names as they are, not escaped for JSON
+    Arena names;            // for decoding names that aren't plain ASCII
+} PathStack;
+
+static void initPathStack(PathStack *ps) {
+    memset(ps, 0, sizeof(*ps));
+    initArena(&ps->names);
+}
+
+static void freePathStack(PathStack *ps) {
+    int raw = ps->raw;
+    free(ps->buf);
+    free(ps->ends);
+    freeArena(&ps->names);
+    initPathStack(ps);
+    ps->raw = raw;
+}
+
+static void pathAppend(PathStack *ps, const char *s, size_t len) {
+    if (ps->len + len > ps->cap) {
+        while (ps->len + len > ps->cap)
+            ps->cap = ps->cap ? ps->cap * 2 : 1024;
+        ps->buf = (char *) realloc(ps->buf, ps->cap);
+        if (!ps->buf) exit(1);
+    }
+    memcpy(ps->buf + ps->len, s, len);
+    ps->len += len;
+}
+
+// Append a key's name, escaped for JSON unless the path is raw
+static void pathAppendName(PathStack *ps, const NK *key) {
+    ArenaMark mark = arenaMark(&ps->names);
+    size_t len;
+    const char *name = keyName(&ps->names, key, &len);
+
+    if (ps->raw) {
+        if (ps->len) pathAppend(ps, "\\", 1);
+        pathAppend(ps, name, len);
+        arenaRelease(&ps->names, mark);
+        return;
+    }
+    if (ps->len) pathAppend(ps, "\\\\", 2);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = name[i];
+        char esc[8];
+        if (c == '"' || c == '\\') {
+            esc[0] = '\\';
+            esc[1] = c;
+            pathAppend(ps, esc, 2);
+        }
+        else if (c < 0x20) {
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            pathAppend(ps, esc, 6);
+        }
+        else {
+            pathAppend(ps, (const char *) &c, 1);
+        }
+    }
+    arenaRelease(&ps->names, mark);
+}
+
+// Make the path that of key, at the given level of the walk
+static void pathPush(PathStack *ps, int level, const NK *key) {
+    if (level >= ps->levels) {
+        ps->levels = ps->levels ? ps->levels * 2 : 64;
+        ps->ends = (size_t *) realloc(ps->ends, ps->levels * sizeof(size_t));
+        if (!ps->ends) exit(1);
+    }
+    ps->len = level ? ps->ends[level - 1] : ps->base;
+    pathAppendName(ps, key);
+    ps->ends[level] = ps->len;
+}
+
+// Start the path with the names of key's ancestors, so that a walk
+// starting part way down the tree still gets full paths
+static void pathSetBase(PathStack *ps, Hive *hive, const NK *key) {
+    const NK *chain[512];
+    int n = 0;
+
+    ps->len = 0;
+    while (key->type != NK_ROOT && n < 512) {
+        key = getNK(hive, key->parent);
+        if (!key) break;
+        chain[n++] = key;
+    }
+    while (n > 0) {
+        key = chain[--n];
+        pathAppendName(ps, key);
+    }
+    ps->base = ps->len;
+}
+
+// Write s as a quoted JSON string
+void rv_writeJsonString(Writer *w, const char *s) {
+    writeChar(w, '"');
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            writeChar(w, '\\');
+            writeChar(w, c);
+        }
+        else if (c < 0x20) {
+            rv_writeFmt(w, "\\u%04x", c);
+        }
+        else {
+            writeChar(w, c);
+        }
+    }
+    writeChar(w, '"');
+}
+
+typedef struct jsonPrinter {
+    Writer *out;
+    PathStack path;
+} JsonPrinter;
+
+// Print the NDJSON record for key, whose path is already on the stack
+static void printJsonRecord(JsonPrinter *jp, Hive *hive, const NK *key) {
+    uint64_t ticks = ((uint64_t) key->modified.dwHighDateTime << 32) |
+        key->modified.dwLowDateTime;
+
+    rv_writeStr(jp->out, "{\"path\":\"");
+    rv_writeBytes(jp->out, jp->path.buf, jp->path.len);
+    rv_writeFmt(jp->out, "\",\"modified\":%u,\"subkeys\":%d,\"values\":%d,\"offset\":%u}\n",
+        WindowsTickToUnixSeconds(ticks), key->num_subkeys,
+        key->num_values > 0 ? key->num_values : 0, cellOffset(hive, key));
+}
+
+// Print one NDJSON record per key
+static int jsonKeyVisitor(Hive *hive, const NK *key, int level, void *ctx) {
+    JsonPrinter *jp = (JsonPrinter *) ctx;
+
+    pathPush(&jp->path, level, key);
+    printJsonRecord(jp, hive, key);
+    return WALK_DESCEND;
+}
+
+// Print a node and its subtree as NDJSON
+void rv_printSubTreeJson(const NK *root, Hive *hive, Writer *out) {
+    JsonPrinter jp;
+    Walker w;
+
+    jp.out = out;
+    initPathStack(&jp.path);
+    pathSetBase(&jp.path, hive, root);
+
+    // Keep the output pure NDJSON
+    initWalker(&w, NULL);
+    walkSubTree(&w, hive, root, 0, jsonKeyVisitor, &jp);
+    freeWalker(&w);
+    freePathStack(&jp.path);
+}
+
+// The hash stored in lh lists: the uppercased UTF-16 units of the
+// name as a base 37 number
+static uint32_t lhHash(const char *name, size_t len) {
+    const uint16_t *up = upcaseTable();
+    NameReader r;
+    uint32_t h = 0;
+    int unit;
+
+    initNameReader(&r, name, len, NAME_UTF8);
+    while ((unit = nextNameUnit(&r)) >= 0) {
+        h = h * 37 + up[unit];
+    }
+    return h;
+}
+
+// Compare an lf hint (the first 4 characters of a key's name, zero
+// padded) against the start of name, in name order.
+static int compareHint(const char *hint, const char *name, size_t len) {
+    for (size_t i = 0; i < 4; i++) {
+        int ch = toupper((unsigned char) hint[i]);
+        int cn = i < len ? toupper((unsigned char) name[i]) : 0;
+        if (ch != cn) return ch - cn;
+        if (!ch) break;
+    }
+    return 0;
+}
+
+// A key that can't be read matches nothing
+static int compareKey(Hive *hive, uint32_t off, const char *name, size_t len) {
+    const NK *key = needNK(hive, off);
+    if (!key) return 1;
+    return compareNameForms(key->name, keyNameLen(key), keyNameForm(key), name, len, NAME_UTF8);
+}
+
+// Look for name in an lh/lf/li list. lf hints are binary searched
+// down to the run that shares the name's first 4 characters, and lh
+// hashes are checked before a key is read; li lists have nothing to
+// go on but the keys, so those are binary searched. Lists ought to be
+// sorted, so the searches only fall back to a scan, still filtered by
+// hint or hash, when they come up empty. Hints are only worked out for
+// ASCII, so an lf list is searched like an li list for any other name.
+static const NK *searchLeaf(Hive *hive, const SubkeyList *list, const char *name, size_t len) {
+    int lo = 0, hi = list->count;
+
+    if (list->kind == LIST_LF &&
+        asciiPrefix((const unsigned char *) name, len) == len) {
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            const HashRec *rec = (const HashRec *) (list->entries + mid * sizeof(HashRec));
+            if (compareHint(rec->hash, name, len) < 0) lo = mid + 1;
+            else hi = mid;
+        }
+        for (int i = lo; i < list->count; i++) {
+            const HashRec *rec = (const HashRec *) (list->entries + i * sizeof(HashRec));
+            if (compareHint(rec->hash, name, len)) break;
+            if (!compareKey(hive, rec->offset, name, len)) return needNK(hive, rec->offset);
+        }
+        for (int i = 0; i < list->count; i++) {
+            const HashRec *rec = (const HashRec *) (list->entries + i * sizeof(HashRec));
+            if (!compareHint(rec->hash, name, len) &&
+                !compareKey(hive, rec->offset, name, len)) {
+                return needNK(hive, rec->offset);
+            }
+        }
+    }
+    else if (list->kind == LIST_LH) {
+        uint32_t hash = lhHash(name, len);
+        for (int i = 0; i < list->count; i++) {
+            const HashRec *rec = (const HashRec *) (list->entries + i * sizeof(HashRec));
+            uint32_t rec_hash;
+            memcpy(&rec_hash, rec->hash, sizeof(rec_hash));
+            if (rec_hash == hash && !compareKey(hive, rec->offset, name, len))
+                return needNK(hive, rec->offset);
+        }
+        // Windows may uppercase more than we know how to
+        if (asciiPrefix((const unsigned char *) name, len) < len) {
+            for (int i = 0; i < list->count; i++) {
+                if (!compareKey(hive, subkeyOffset(list, i), name, len))
+                    return needNK(hive, subkeyOffset(list, i));
+            }
+        }
+    }
+    else {
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            int c = compareKey(hive, subkeyOffset(list, mid), name, len);
+            if (!c) return needNK(hive, subkeyOffset(list, mid));
+            if (c < 0) lo = mid + 1;
+            else hi = mid;
+        }
+        for (int i = 0; i < list->count; i++) {
+            if (!compareKey(hive, subkeyOffset(list, i), name, len))
+                return needNK(hive, subkeyOffset(list, i));
+        }
+    }
+    return NULL;
+}
+
+// Read the i'th list of an ri list. Return value: 1, or 0 after
+// hiveError.
+static int needLeaf(Hive *hive, const SubkeyList *ri, int i, SubkeyList *leaf) {
+    int ok = decodeSubkeyList(hive, subkeyOffset(ri, i), leaf);
+    if (ok < 0) return 0;
+    if (!ok || leaf->indirect) {
+        hiveError("Fatal: encountered unknown subentry of ri list");
+        return 0;
+    }
+    return 1;
+}
+
+// Find the subkey of parent called name, or return NULL
+static const NK *findSubkey(Hive *hive, const NK *parent, const char *name, size_t len) {
+    SubkeyList list, leaf;
+
+    if (!hasSubkeys(parent)) return NULL;
+    int ok = decodeSubkeyList(hive, parent->subkeys, &list);
+    if (!ok) hiveError("Fatal: encountered unknown subkey type");
+    if (ok <= 0) return NULL;
+    if (!list.indirect) return searchLeaf(hive, &list, name, len);
+
+    // The lists under an ri are in order too: the name can only be in
+    // the first one whose last key doesn't sort before it
+    int lo = 0, hi = list.count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (!needLeaf(hive, &list, mid, &leaf)) return NULL;
+        if (leaf.count &&
+            compareKey(hive, subkeyOffset(&leaf, leaf.count - 1), name, len) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < list.count) {
+        if (!needLeaf(hive, &list, lo, &leaf)) return NULL;
+        const NK *key = searchLeaf(hive, &leaf, name, len);
+        if (key) return key;
+    }
+    for (int i = 0; i < list.count; i++) {
+        if (i == lo) continue;
+        if (!needLeaf(hive, &list, i, &leaf)) return NULL;
+        const NK *key = searchLeaf(hive, &leaf, name, len);
+        if (key) return key;
+    }
+    return NULL;
+}
+
+// Split the next component off a backslash-separated key path.
+// Return value: 0 when there are no components left.
+static int nextComponent(const char **path, const char **name, size_t *len) {
+    while (**path == '\\') (*path)++;
+    if (!**path) return 0;
+    *name = *path;
+    while (**path && **path != '\\') (*path)++;
+    *len = *path - *name;
+    return 1;
+}
+
+// Find the key at path, relative to root, or return NULL
+const NK *rv_lookupKey(Hive *hive, const NK *root, const char *path) {
+    const NK *key = root;
+    const char *name;
+    size_t len;
+
+    while (key && nextComponent(&path, &name, &len)) {
+        key = findSubkey(hive, key, name, len);
+    }
+    return key;
+}
+
+void rv_initKeyFilter(KeyFilter *f) {
+    memset(f, 0, sizeof(*f));
+    f->max_depth = -1;
+    f->before = UINT64_MAX;
+}
+
+void rv_setFilterGlob(KeyFilter *f, const char *glob) {
+    f->glob = glob;
+    f->glob_len = strlen(glob);
+    f->literal = strcspn(glob, "*?");
+}
+
+// Does the filter apply at all, and does it select by more than depth?
+int rv_filterActive(const KeyFilter *f) {
+    return f->max_depth >= 0 || f->glob || f->after || f->before != UINT64_MAX;
+}
+
+static int filterSelects(const KeyFilter *f) {
+    return f->glob || f->after || f->before != UINT64_MAX;
+}
+
+// Match s against a glob, a character at a time. If partial, it's
+// enough for s to be the start of something that matches.
+static int globMatch(const char *glob, const char *s, size_t len, int partial) {
+    const unsigned char *g = (const unsigned char *) glob, *p = (const unsigned char *) s;
+    const uint16_t *up = upcaseTable();
+    size_t glob_len = strlen(glob), gi = 0, i = 0;
+    size_t star = SIZE_MAX, star_i = 0;
+
+    while (i < len) {
+        if (gi < glob_len && g[gi] == '*') {
+            star = ++gi;
+            star_i = i;
+            continue;
+        }
+        if (gi < glob_len) {
+            size_t g_next = gi, next = i;
+            uint32_t gc = nextUtf8(g, glob_len, &g_next);
+            uint32_t c = nextUtf8(p, len, &next);
+            if (gc == '?' || gc == c ||
+                (gc < 0x10000 && c < 0x10000 && up[gc] == up[c])) {
+                gi = g_next;
+                i = next;
+                continue;
+            }
+        }
+        if (star == SIZE_MAX) return 0;
+        gi = star;
+        nextUtf8(p, len, &star_i);
+        i = star_i;
+    }
+    if (partial) return 1;
+    while (gi < glob_len && g[gi] == '*') gi++;
+    return gi == glob_len;
+}
+
+// Parse a time as YYYY-MM-DD, optionally followed by HH:MM[:SS], in
+// UTC. Return value: 1 on success, 0 if it isn't one.
+int rv_parseFilterTime(const char *s, uint64_t *ticks) {
+    struct tm tm;
+    char sep;
+    int n = 0;
+
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(s, "%d-%d-%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &n) != 3)
+        return 0;
+    s += n;
+    if (*s && (sscanf(s, "%c%d:%d%n", &sep, &tm.tm_hour, &tm.tm_min, &n) != 3 ||
+        (sep != ' ' && sep != 'T')))
+        return 0;
+    if (*s) {
+        s += n;
+        if (*s == ':' && sscanf(s, ":%d%n", &tm.tm_sec, &n) == 1) s += n;
+        if (*s) return 0;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    time_t t = timegm(&tm);
+    if (t == (time_t) -1) return 0;
+    *ticks = ((uint64_t) t + SEC_TO_UNIX_EPOCH) * WINDOWS_TICK;
+    return 1;
+}
+
+// Timelines: every key the filter lets through, as (LastWrite, path),
+// sorted oldest first and written as a bodyfile for mactime or as CSV.
+// Keys are collected into runs of at most the memory budget, each
+// sorted with a radix sort on the 64 bit FILETIME, which being stable
+// keeps keys with the same time in walk order. If everything fits in
+// one run it is written straight out; otherwise the runs go to
+// temporary files and are merged.
+typedef struct timelineEntry {
+    uint64_t ticks;
+    uint64_t path;              // offset of its path in the run's paths
+} TimelineEntry;
+
+typedef struct timeline {
+    TimelineEntry *entries;
+    TimelineEntry *scratch;     // for the sort
+    size_t count;
+    size_t cap;
+    char *paths;                // NUL terminated
+    size_t paths_len;
+    size_t paths_cap;
+    size_t budget;              // bytes for entries, scratch and paths
+    int nthreads;
+    FILE **runs;
+    int nruns;
+} Timeline;
+
+// One thread's share of a radix sort
+typedef struct radixSort {
+    TimelineEntry *src;
+    TimelineEntry *dst;
+    size_t n;
+    int nthreads;
+    size_t (*counts)[256];      // per thread, then where its keys go
+    int skip;                   // every key has the same digit
+    pthread_barrier_t barrier;
+} RadixSort;
+
+typedef struct radixWorker {
+    RadixSort *rs;
+    int t;
+} RadixWorker;
+
+// Sort a slice of the array a byte at a time, least significant first,
+// waiting at the barrier for the other threads between steps
+static void *radixWorker(void *arg) {
+    RadixWorker *rw = (RadixWorker *) arg;
+    RadixSort *rs = rw->rs;
+    int t = rw->t;
+    size_t lo = rs->n * t / rs->nthreads, hi = rs->n * (t + 1) / rs->nthreads;
+
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t *counts = rs->counts[t];
+        memset(counts, 0, sizeof(rs->counts[t]));
+        for (size_t i = lo; i < hi; i++)
+            counts[(rs->src[i].ticks >> shift) & 0xff]++;
+        pthread_barrier_wait(&rs->barrier);
+
+        // Buckets in order, and within each, threads in order
+        if (t == 0) {
+            size_t off = 0;
+            rs->skip = 0;
+            for (int b = 0; b < 256; b++) {
+                size_t total = 0;
+                for (int th = 0; th < rs->nthreads; th++) {
+                    size_t c = rs->counts[th][b];
+                    rs->counts[th][b] = off;
+                    off += c;
+                    total += c;
+                }
+                if (total == rs->n) rs->skip = 1;
+            }
+        }
+        pthread_barrier_wait(&rs->barrier);
+        if (rs->skip) continue;
+
+        for (size_t i = lo; i < hi; i++)
+            rs->dst[counts[(rs->src[i].ticks >> shift) & 0xff]++] = rs->src[i];
+        pthread_barrier_wait(&rs->barrier);
+        if (t == 0) {
+            TimelineEntry *tmp = rs->src;
+            rs->src = rs->dst;
+            rs->dst = tmp;
+        }
+        pthread_barrier_wait(&rs->barrier);
+    }
+    return NULL;
+}
+
+// Sort the entries of a run by time on up to nthreads threads, using
+// scratch, which is as big, for the stages in between
+static void sortTimeline(TimelineEntry *entries, TimelineEntry *scratch, size_t n, int nthreads) {
+    RadixSort rs;
+
+    // Threads don't pay for themselves on small runs
+    if (n < 65536) nthreads = 1;
+    rs.src = entries;
+    rs.dst = scratch;
+    rs.n = n;
+    rs.nthreads = nthreads;
+    rs.counts = (size_t (*)[256]) malloc(nthreads * sizeof(*rs.counts));
+    RadixWorker *workers = (RadixWorker *) malloc(nthreads * sizeof(RadixWorker));
+    pthread_t *threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+    if (!rs.counts || !workers || !threads) exit(1);
+    pthread_barrier_init(&rs.barrier, NULL, nthreads);
+
+    for (int t = 0; t < nthreads; t++) {
+        workers[t].rs = &rs;
+        workers[t].t = t;
+        if (t && pthread_create(&threads[t], NULL, radixWorker, &workers[t])) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    radixWorker(&workers[0]);
+    for (int t = 1; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    if (rs.src != entries) memcpy(entries, rs.src, n * sizeof(TimelineEntry));
+    pthread_barrier_destroy(&rs.barrier);
+    free(rs.counts);
+    free(workers);
+    free(threads);
+}
+
+// Formats FILETIMEs as ISO 8601 UTC with all seven digits of the
+// fraction. In a timeline consecutive times mostly fall on the same
+// day, so the date is kept from the last call and only the time of day
+// is worked out each time, which is just arithmetic.
+typedef struct timeFormatter {
+    int64_t day;                // since 1601, of the date
+    char date[32];              // YYYY-MM-DDT
+    int date_len;
+} TimeFormatter;
+
+static void initTimeFormatter(TimeFormatter *tf) {
+    tf->day = -1;
+    tf->date_len = 0;
+}
+
+static void writeTicks(TimeFormatter *tf, uint64_t ticks, Writer *out) {
+    uint64_t secs = ticks / WINDOWS_TICK;
+    uint32_t frac = ticks % WINDOWS_TICK;
+
+    if ((int64_t) (secs / 86400) != tf->day) {
+        tf->day = secs / 86400;
+        time_t t = (time_t) (tf->day * 86400 - SEC_TO_UNIX_EPOCH);
+        struct tm tm;
+        if (gmtime_r(&t, &tm))
+            tf->date_len = snprintf(tf->date, sizeof(tf->date), "%04d-%02d-%02dT",
+                tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+        else
+            tf->date_len = snprintf(tf->date, sizeof(tf->date), "?T");
+    }
+
+    // HH:MM:SS.fffffffZ
+    char buf[17];
+    uint32_t s = secs % 86400;
+    uint32_t parts[3] = { s / 3600, s / 60 % 60, s % 60 };
+    for (int i = 0; i < 3; i++) {
+        buf[i * 3] = '0' + parts[i] / 10;
+        buf[i * 3 + 1] = '0' + parts[i] % 10;
+        buf[i * 3 + 2] = i < 2 ? ':' : '.';
+    }
+    for (int i = 15; i >= 9; i--) {
+        buf[i] = '0' + frac % 10;
+        frac /= 10;
+    }
+    buf[16] = 'Z';
+    rv_writeBytes(out, tf->date, tf->date_len);
+    rv_writeBytes(out, buf, sizeof(buf));
+}
+
+// Write n in decimal
+static void writeDecimal(Writer *w, int64_t n) {
+    char buf[24];
+    int i = sizeof(buf);
+    uint64_t u = n < 0 ? -(uint64_t) n : (uint64_t) n;
+
+    do {
+        buf[--i] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (n < 0) buf[--i] = '-';
+    rv_writeBytes(w, buf + i, sizeof(buf) - i);
+}
+
+// Write a line of the timeline
+static void writeTimelineEntry(int format, TimeFormatter *tf, uint64_t ticks,
+        const char *path, size_t len, Writer *out) {
+    if (format == TIMELINE_CSV) {
+        writeTicks(tf, ticks, out);
+        writeChar(out, ',');
+        if (memchr(path, ',', len) || memchr(path, '"', len) ||
+            memchr(path, '\n', len) || memchr(path, '\r', len)) {
+            writeChar(out, '"');
+            for (size_t i = 0; i < len; i++) {
+                if (path[i] == '"') writeChar(out, '"');
+                writeChar(out, path[i]);
+            }
+            writeChar(out, '"');
+        }
+        else {
+            rv_writeBytes(out, path, len);
+        }
+        writeChar(out, '\n');
+        return;
+    }
+
+    // MD5|name|inode|mode|UID|GID|size|atime|mtime|ctime|crtime, with
+    // only mtime known. Times before 1970 come out negative. The format
+    // has no quoting, so a name with a '|' or line break in it has
+    // those percent-encoded, along with '%' itself.
+    int64_t secs = (int64_t) (ticks / WINDOWS_TICK) - SEC_TO_UNIX_EPOCH;
+    rv_writeStr(out, "0|");
+    if (memchr(path, '|', len) || memchr(path, '%', len) ||
+        memchr(path, '\n', len) || memchr(path, '\r', len)) {
+        for (size_t i = 0; i < len; i++) {
+            char c = path[i];
+            if (c == '|' || c == '%' || c == '\n' || c == '\r')
+                rv_writeFmt(out, "%%%02X", (unsigned char) c);
+            else
+                writeChar(out, c);
+        }
+    }
+    else {
+        rv_writeBytes(out, path, len);
+    }
+    rv_writeStr(out, "|0|0|0|0|0|0|");
+    writeDecimal(out, secs);
+    rv_writeStr(out, "|0|0\n");
+}
+
+static void initTimeline(Timeline *tl, size_t budget, int nthreads) {
+    memset(tl, 0, sizeof(*tl));
+    tl->budget = budget;
+    tl->nthreads = nthreads > 0 ? nthreads : 1;
+}
+
+// Sort the run collected so far and write it to a temporary file
+static void spillTimeline(Timeline *tl) {
+    FILE *f = tmpfile();
+    if (!f) {
+        perror("tmpfile");
+        exit(1);
+    }
+    sortTimeline(tl->entries, tl->scratch, tl->count, tl->nthreads);
+    for (size_t i = 0; i < tl->count; i++) {
+        const char *path = tl->paths + tl->entries[i].path;
+        uint32_t len = strlen(path);
+        if (fwrite(&tl->entries[i].ticks, sizeof(uint64_t), 1, f) != 1 ||
+            fwrite(&len, sizeof(len), 1, f) != 1 || fwrite(path, 1, len, f) != len) {
+            perror("fwrite");
+            exit(1);
+        }
+    }
+    rewind(f);
+    tl->runs = (FILE **) realloc(tl->runs, (tl->nruns + 1) * sizeof(FILE *));
+    if (!tl->runs) exit(1);
+    tl->runs[tl->nruns++] = f;
+    tl->count = 0;
+    tl->paths_len = 0;
+}
+
+static void addTimelineKey(Timeline *tl, uint64_t ticks, const char *path, size_t len) {
+    if (tl->count && (tl->count + 1) * 2 * sizeof(TimelineEntry) +
+        tl->paths_len + len + 1 > tl->budget)
+        spillTimeline(tl);
+
+    if (tl->count == tl->cap) {
+        tl->cap = tl->cap ? tl->cap * 2 : 4096;
+        tl->entries = (TimelineEntry *) realloc(tl->entries, tl->cap * sizeof(TimelineEntry));
+        free(tl->scratch);
+        tl->scratch = (TimelineEntry *) malloc(tl->cap * sizeof(TimelineEntry));
+        if (!tl->entries || !tl->scratch) exit(1);
+    }
+    if (tl->paths_len + len + 1 > tl->paths_cap) {
+        while (tl->paths_len + len + 1 > tl->paths_cap)
+            tl->paths_cap = tl->paths_cap ? tl->paths_cap * 2 : 65536;
+        tl->paths = (char *) realloc(tl->paths, tl->paths_cap);
+        if (!tl->paths) exit(1);
+    }
+    tl->entries[tl->count].ticks = ticks;
+    tl->entries[tl->count].path = tl->paths_len;
+    tl->count++;
+    memcpy(tl->paths + tl->paths_len, path, len);
+    tl->paths_len += len;
+    tl->paths[tl->paths_len++] = 0;
+}
+
+// The next entry of a spilled run, read into a buffer of its own
+typedef struct runHead {
+    uint64_t ticks;
+    char *path;
+    uint32_t len;
+    uint32_t cap;
+    int run;
+} RunHead;
+
+static int readRunHead(FILE *f, RunHead *h) {
+    if (fread(&h->ticks, sizeof(uint64_t), 1, f) != 1 || fread(&h->len, sizeof(h->len), 1, f) != 1)
+        return 0;
+    if (h->len > h->cap) {
+        h->cap = h->len;
+        h->path = (char *) realloc(h->path, h->cap);
+        if (!h->path) exit(1);
+    }
+    return fread(h->path, 1, h->len, f) == h->len;
+}
+
+// Which of two heads comes first: the older, or for the same time, the
+// one from the earlier run, so that ties stay in walk order
+static inline int runHeadBefore(const RunHead *a, const RunHead *b) {
+    return a->ticks < b->ticks || (a->ticks == b->ticks && a->run < b->run);
+}
+
+static void siftRunHeads(RunHead *heap, int n, int i) {
+    while (1) {
+        int first = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && runHeadBefore(&heap[l], &heap[first])) first = l;
+        if (r < n && runHeadBefore(&heap[r], &heap[first])) first = r;
+        if (first == i) return;
+        RunHead tmp = heap[i];
+        heap[i] = heap[first];
+        heap[first] = tmp;
+        i = first;
+    }
+}
+
+// Write out everything collected, sorted
+static void finishTimeline(Timeline *tl, int format, Writer *out) {
+    TimeFormatter tf;
+
+    initTimeFormatter(&tf);
+    if (format == TIMELINE_CSV) rv_writeStr(out, "LastWrite,Key\n");
+    if (!tl->nruns) {
+        sortTimeline(tl->entries, tl->scratch, tl->count, tl->nthreads);
+        for (size_t i = 0; i < tl->count; i++) {
+            const char *path = tl->paths + tl->entries[i].path;
+            writeTimelineEntry(format, &tf, tl->entries[i].ticks, path, strlen(path), out);
+        }
+        return;
+    }
+
+    // Merge the runs, with a heap of the next entry from each
+    if (tl->count) spillTimeline(tl);
+    RunHead *heap = (RunHead *) calloc(tl->nruns, sizeof(RunHead));
+    int n = 0;
+    if (!heap) exit(1);
+    for (int r = 0; r < tl->nruns; r++) {
+        heap[n].run = r;
+        if (readRunHead(tl->runs[r], &heap[n])) n++;
+        else free(heap[n].path);
+    }
+    for (int i = n / 2 - 1; i >= 0; i--) siftRunHeads(heap, n, i);
+    while (n > 0) {
+        writeTimelineEntry(format, &tf, heap[0].ticks, heap[0].path, heap[0].len, out);
+        if (!readRunHead(tl->runs[heap[0].run], &heap[0])) {
+            RunHead done = heap[0];
+            heap[0] = heap[--n];
+            heap[n] = done;
+        }
+        siftRunHeads(heap, n, 0);
+    }
+    for (int r = 0; r < tl->nruns; r++) free(heap[r].path);
+    free(heap);
+}
+
+static void freeTimeline(Timeline *tl) {
+    for (int r = 0; r < tl->nruns; r++) fclose(tl->runs[r]);
+    free(tl->runs);
+    free(tl->entries);
+    free(tl->scratch);
+    free(tl->paths);
+}
+
+// A walk that only prints what a filter lets through. Paths are kept
+// for the glob, and when printing JSON, escaped for that too.
+typedef struct filterWalk {
+    const KeyFilter *filter;
+    PathStack path;
+    Printer *printer;           // or, for JSON:
+    JsonPrinter *json;
+    Timeline *timeline;         // or to collect keys for a timeline
+} FilterWalk;
+
+static int filterKeyVisitor(Hive *hive, const NK *key, int level, void *ctx) {
+    FilterWalk *fw = (FilterWalk *) ctx;
+    const KeyFilter *f = fw->filter;
+    uint64_t ticks = ((uint64_t) key->modified.dwHighDateTime << 32) |
+        key->modified.dwLowDateTime;
+
+    pathPush(&fw->path, level, key);
+    if (fw->json) pathPush(&fw->json->path, level, key);
+
+    if ((!f->glob || globMatch(f->glob, fw->path.buf, fw->path.len, 0)) &&
+        ticks >= f->after && ticks <= f->before) {
+        if (fw->timeline) {
+            addTimelineKey(fw->timeline, ticks, fw->path.buf, fw->path.len);
+        }
+        else if (fw->json) {
+            printJsonRecord(fw->json, hive, key);
+        }
+        else if (filterSelects(f)) {
+            // Matches on their own need their full path to make sense
+            Printer *p = fw->printer;
+            rv_writeBytes(p->out, fw->path.buf, fw->path.len);
+            writeChar(p->out, '\n');
+            printKeyValues(p, hive, key, 1);
+        }
+        else {
+            printKey(fw->printer, hive, key, level);
+        }
+    }
+
+    if (f->max_depth >= 0 && level >= f->max_depth) return WALK_SKIP;
+    if (f->glob) {
+        // Could anything below here still match?
+        pathAppend(&fw->path, "\\", 1);
+        int maybe = globMatch(f->glob, fw->path.buf, fw->path.len, 1);
+        fw->path.len--;
+        if (!maybe) return WALK_SKIP;
+    }
+    return WALK_DESCEND;
+}
+
+// Rule out subkeys whose names can't start with the literal part of
+// the glob at this level, going by lf hints and lh hashes, as long as
+// that part is ASCII
+static int filterSubkey(const SubkeyList *list, int i, int level, void *ctx) {
+    FilterWalk *fw = (FilterWalk *) ctx;
+    const KeyFilter *f = fw->filter;
+    size_t start = fw->path.ends[level - 1] + 1;
+
+    if (!f->glob || start >= f->literal || list->stride != sizeof(HashRec))
+        return 1;
+
+    // The glob's literal part covers the start of this level's name,
+    // or all of it if that ends before any wildcard
+    const char *want = f->glob + start;
+    size_t len = strcspn(want, "\\");
+    int whole = start + len <= f->literal;
+    if (!whole) len = f->literal - start;
+    if (asciiPrefix((const unsigned char *) want, len) < len) return 1;
+
+    const HashRec *rec = (const HashRec *) (list->entries + i * list->stride);
+    if (list->kind == LIST_LF) {
+        if (whole) return !compareHint(rec->hash, want, len);
+        for (size_t k = 0; k < len && k < 4; k++) {
+            if (toupper((unsigned char) rec->hash[k]) != toupper((unsigned char) want[k]))
+                return 0;
+        }
+        return 1;
+    }
+    if (whole) {
+        uint32_t hash;
+        memcpy(&hash, rec->hash, sizeof(hash));
+        return hash == lhHash(want, len);
+    }
+    return 1;
+}
+
+// Print the keys under root, root included, that f lets through:
+// as NDJSON records if json, else as full paths, or for a filter on
+// depth alone, as the usual tree
+void rv_printSubTreeFiltered(const NK *root, Hive *hive, const KeyFilter *f, int json,
+        const PrintOptions *opts, Writer *out) {
+    FilterWalk fw;
+    JsonPrinter jp;
+    Printer p;
+    Walker w;
+
+    fw.filter = f;
+    initPathStack(&fw.path);
+    fw.path.raw = 1;
+    pathSetBase(&fw.path, hive, root);
+    initPrinter(&p, out, opts);
+    fw.printer = &p;
+    fw.json = NULL;
+    fw.timeline = NULL;
+    if (json) {
+        jp.out = out;
+        initPathStack(&jp.path);
+        pathSetBase(&jp.path, hive, root);
+        fw.json = &jp;
+    }
+
+    initWalker(&w, json ? NULL : out);
+    w.filter = filterSubkey;
+    w.filter_ctx = &fw;
+    walkSubTree(&w, hive, root, 0, filterKeyVisitor, &fw);
+    freeWalker(&w);
+    if (json) freePathStack(&jp.path);
+    freePrinter(&p);
+    freePathStack(&fw.path);
+}
+
+// Print a timeline of the keys under root, root included, that f lets
+// through: in the given TIMELINE_ format, sorted on nthreads threads
+// in runs of at most budget bytes
+void rv_printTimeline(const NK *root, Hive *hive, const KeyFilter *f, int format,
+        int nthreads, size_t budget, Writer *out) {
+    FilterWalk fw;
+    Timeline tl;
+    Walker w;
+
+    memset(&fw, 0, sizeof(fw));
+    fw.filter = f;
+    initPathStack(&fw.path);
+    fw.path.raw = 1;
+    pathSetBase(&fw.path, hive, root);
+    initTimeline(&tl, budget, nthreads);
+    fw.timeline = &tl;
+
+    initWalker(&w, NULL);
+    w.filter = filterSubkey;
+    w.filter_ctx = &fw;
+    walkSubTree(&w, hive, root, 0, filterKeyVisitor, &fw);
+    freeWalker(&w);
+    freePathStack(&fw.path);
+
+    finishTimeline(&tl, format, out);
+    freeTimeline(&tl);
+}
+
+// Scanning kernels. These run over whole hbins (or the header), so
+// they get vector versions for AVX2, SSE2 and NEON, picked at compile
+// time, plus plain C for anything else. Build with CFLAGS=-mavx2 or
+// -march=native to get the AVX2 ones on x86.
+
+// XOR of n little-endian 32 bit words starting at buf
+static uint32_t xorWords(const void *buf, size_t n) {
+    const unsigned char *p = (const unsigned char *) buf;
+    uint32_t x = 0, word;
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    __m256i acc = _mm256_setzero_si256();
+    for (; i + 8 <= n; i += 8)
+        acc = _mm256_xor_si256(acc, _mm256_loadu_si256((const __m256i *) (p + i * 4)));
+    __m128i acc4 = _mm_xor_si128(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    acc4 = _mm_xor_si128(acc4, _mm_shuffle_epi32(acc4, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc4 = _mm_xor_si128(acc4, _mm_shuffle_epi32(acc4, _MM_SHUFFLE(2, 3, 0, 1)));
+    x = (uint32_t) _mm_cvtsi128_si32(acc4);
+#elif defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4)
+        acc = _mm_xor_si128(acc, _mm_loadu_si128((const __m128i *) (p + i * 4)));
+    acc = _mm_xor_si128(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_xor_si128(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    x = (uint32_t) _mm_cvtsi128_si32(acc);
+#elif defined(__ARM_NEON)
+    uint32x4_t acc = vdupq_n_u32(0);
+    for (; i + 4 <= n; i += 4)
+        acc = veorq_u32(acc, vreinterpretq_u32_u8(vld1q_u8(p + i * 4)));
+    x = vgetq_lane_u32(acc, 0) ^ vgetq_lane_u32(acc, 1) ^
+        vgetq_lane_u32(acc, 2) ^ vgetq_lane_u32(acc, 3);
+#endif
+    for (; i < n; i++) {
+        memcpy(&word, p + i * 4, 4);
+        x ^= word;
+    }
+    return x;
+}
+
+// Signatures findSignature can look for. Cells are 8 byte aligned, so
+// only every eighth position is checked: 'hbin' at the start of an 8
+// byte slot, and 'nk'/'vk' after the 4 byte cell size.
+#define SIG_HBIN 1
+#define SIG_NK 2
+#define SIG_VK 4
+
+// Byte masks of where in an 8 byte slot each kind of signature goes
+#define SIG_HBIN_BYTES 0x0F
+#define SIG_CELL_BYTES 0x30
+
+static inline int slotSignature(const unsigned char *slot, size_t room, int which) {
+    if ((which & SIG_HBIN) && room >= 4 && !memcmp(slot, "hbin", 4)) return SIG_HBIN;
+    if (room < 6) return 0;
+    if ((which & SIG_NK) && slot[4] == 'n' && slot[5] == 'k') return SIG_NK;
+    if ((which & SIG_VK) && slot[4] == 'v' && slot[5] == 'k') return SIG_VK;
+    return 0;
+}
+
+// Find the first 8 byte slot at or after pos (a multiple of 8) and
+// before end holding one of the signatures in which, with *type set to
+// the one found. Return value: the slot's offset in buf, or end if
+// there are none.
+static size_t findSignature(const unsigned char *buf, size_t pos, size_t end, int which, int *type) {
+#if defined(__AVX2__) || defined(__SSE2__) || defined(__ARM_NEON)
+    // A signature not asked for is compared as the other one, not as 0
+    uint32_t hbin_sig;
+    uint16_t cell_sig[2];
+    memcpy(&hbin_sig, "hbin", 4);
+    cell_sig[0] = (which & SIG_NK) ? 'n' | 'k' << 8 : 'v' | 'k' << 8;
+    cell_sig[1] = (which & SIG_VK) ? 'v' | 'k' << 8 : cell_sig[0];
+#endif
+#if defined(__AVX2__)
+    const __m256i hbin = _mm256_set1_epi32((int) hbin_sig);
+    const __m256i nk = _mm256_set1_epi16((short) cell_sig[0]);
+    const __m256i vk = _mm256_set1_epi16((short) cell_sig[1]);
+    for (; pos + 32 <= end; pos += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (buf + pos));
+        uint32_t hits = 0;
+        if (which & SIG_HBIN)
+            hits |= (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi32(v, hbin)) & SIG_HBIN_BYTES * 0x01010101u;
+        if (which & (SIG_NK | SIG_VK))
+            hits |= (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(
+                _mm256_cmpeq_epi16(v, nk), _mm256_cmpeq_epi16(v, vk))) & SIG_CELL_BYTES * 0x01010101u;
+        if (hits) {
+            pos += __builtin_ctz(hits) & ~7;
+            break;
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i hbin = _mm_set1_epi32((int) hbin_sig);
+    const __m128i nk = _mm_set1_epi16((short) cell_sig[0]);
+    const __m128i vk = _mm_set1_epi16((short) cell_sig[1]);
+    for (; pos + 16 <= end; pos += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (buf + pos));
+        uint32_t hits = 0;
+        if (which & SIG_HBIN)
+            hits |= (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi32(v, hbin)) & SIG_HBIN_BYTES * 0x0101u;
+        if (which & (SIG_NK | SIG_VK))
+            hits |= (uint32_t) _mm_movemask_epi8(_mm_or_si128(
+                _mm_cmpeq_epi16(v, nk), _mm_cmpeq_epi16(v, vk))) & SIG_CELL_BYTES * 0x0101u;
+        if (hits) {
+            pos += __builtin_ctz(hits) & ~7;
+            break;
+        }
+    }
+#elif defined(__ARM_NEON)
+    // No movemask here: narrow each byte's compare result to a nibble
+    const uint8x16_t hbin = vreinterpretq_u8_u32(vdupq_n_u32(hbin_sig));
+    const uint8x16_t nk = vreinterpretq_u8_u16(vdupq_n_u16(cell_sig[0]));
+    const uint8x16_t vk = vreinterpretq_u8_u16(vdupq_n_u16(cell_sig[1]));
+    for (; pos + 16 <= end; pos += 16) {
+        uint8x16_t v = vld1q_u8(buf + pos);
+        uint64_t hits = 0;
+        if (which & SIG_HBIN) {
+            uint8x16_t eq = vreinterpretq_u8_u32(vceqq_u32(vreinterpretq_u32_u8(v), vreinterpretq_u32_u8(hbin)));
+            hits |= vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0) &
+                0x0000FFFF0000FFFFull;
+        }
+        if (which & (SIG_NK | SIG_VK)) {
+            uint16x8_t w = vreinterpretq_u16_u8(v);
+            uint8x16_t eq = vreinterpretq_u8_u16(vorrq_u16(vceqq_u16(w, vreinterpretq_u16_u8(nk)),
+                vceqq_u16(w, vreinterpretq_u16_u8(vk))));
+            hits |= vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0) &
+                0x00FF000000FF0000ull;
+        }
+        if (hits) {
+            pos += (__builtin_ctzll(hits) / 4) & ~7;
+            break;
+        }
+    }
+#endif
+    for (; pos < end; pos += 8) {
+        if ((*type = slotSignature(buf + pos, end - pos, which))) return pos;
+    }
+    return end;
+}
+
+// Cell types, as classified by signature during a sweep. Free cells
+// keep whatever signature they had when they were released, and are
+// recorded as that type with CELL_FREE set.
+#define CELL_DATA 0
+#define CELL_NK 1
+#define CELL_VK 2
+#define CELL_SK 3
+#define CELL_LF 4
+#define CELL_LH 5
+#define CELL_LI 6
+#define CELL_RI 7
+#define CELL_DB 8
+#define NUM_CELL_TYPES 9
+#define CELL_FREE 0x80
+
+static const char *cellTypeNames[NUM_CELL_TYPES] = {
+    "data", "nk", "vk", "sk", "lf", "lh", "li", "ri", "db"
+};
+
+static int classifyCell(const char *sig) {
+    switch (cellSignature(sig)) {
+    case SIG('n', 'k'): return CELL_NK;
+    case SIG('v', 'k'): return CELL_VK;
+    case SIG('s', 'k'): return CELL_SK;
+    case SIG('l', 'f'): return CELL_LF;
+    case SIG('l', 'h'): return CELL_LH;
+    case SIG('l', 'i'): return CELL_LI;
+    case SIG('r', 'i'): return CELL_RI;
+    case SIG('d', 'b'): return CELL_DB;
+    default: return CELL_DATA;
+    }
+}
+
+// Offset to type index of every cell in the hive, built by sweepHive.
+// Offsets are in the same form as the ones stored in the hive
+// (relative to the first hbin, pointing at the cell size) and are
+// kept in ascending order.
+typedef struct cellIndex {
+    uint32_t *offsets;
+    unsigned char *types;
+    uint32_t count;
+    uint32_t cap;
+    uint32_t nbins;
+} CellIndex;
+
+static void freeCellIndex(CellIndex *idx) {
+    free(idx->offsets);
+    free(idx->types);
+    memset(idx, 0, sizeof(*idx));
+}
+
+static void addCell(CellIndex *idx, uint32_t off, int type) {
+    if (idx->count == idx->cap) {
+        idx->cap = idx->cap ? idx->cap * 2 : 4096;
+        idx->offsets = (uint32_t *) realloc(idx->offsets, idx->cap * sizeof(uint32_t));
+        idx->types = (unsigned char *) realloc(idx->types, idx->cap);
+        if (!idx->offsets || !idx->types) exit(1);
+    }
+    idx->offsets[idx->count] = off;
+    idx->types[idx->count] = type;
+    idx->count++;
+}
+
+// Position in the index of the cell starting at off, or -1 if no
+// cell starts there
+static int64_t findCell(const CellIndex *idx, uint32_t off) {
+    uint32_t lo = 0, hi = idx->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (idx->offsets[mid] < off) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo < idx->count && idx->offsets[lo] == off) return lo;
+    return -1;
+}
+
+// Type of the cell starting at off, or -1 if no cell starts there
+static int cellType(const CellIndex *idx, uint32_t off) {
+    int64_t i = findCell(idx, off);
+    return i < 0 ? -1 : idx->types[i];
+}
+
+// Size of the hbin starting at pos, or 0 if there isn't a sane one.
+// The size is normally in next; some writers only fill in block_size.
+static uint32_t hbinSize(Hive *hive, size_t pos) {
+    if (pos + sizeof(BlockHeader) > hive->size) return 0;
+    const BlockHeader *bh = (const BlockHeader *) (hive->base + pos);
+    if (strncmp(bh->signature, "hbin", 4)) return 0;
+
+    uint32_t sizes[2] = { bh->next, bh->block_size };
+    for (int i = 0; i < 2; i++) {
+        if (sizes[i] >= 0x1000 && sizes[i] % 0x1000 == 0 &&
+            sizes[i] <= hive->size - pos) {
+            return sizes[i];
+        }
+    }
+    return 0;
+}
+
+// The next page-aligned sane hbin header after pos, or end if none
+static size_t nextHbin(Hive *hive, size_t pos, size_t end) {
+    int type;
+    for (pos += 8; (pos = findSignature(hive->base, pos, end, SIG_HBIN, &type)) < end; pos += 8) {
+        if (pos % 0x1000 == 0 && hbinSize(hive, pos)) break;
+    }
+    return pos;
+}
+
+// Walk every hbin from the start of the hive to the end, front to
+// back, and index every allocated and free cell in it. A damaged hbin
+// header is skipped over to the next good one. Return value: 1 if the
+// whole hive was swept cleanly, 0 if some of it had to be skipped.
+static int sweepHive(Hive *hive, CellIndex *idx, Writer *out) {
+    const HiveHeader *hdr = (const HiveHeader *) hive->base;
+    size_t end = hive->size;
+    size_t pos = 0x1000;
+    int clean = 1;
+
+    if (hdr->last_block && 0x1000 + (size_t) hdr->last_block < end)
+        end = 0x1000 + (size_t) hdr->last_block;
+    memset(idx, 0, sizeof(*idx));
+    posix_madvise((void *) hive->base, hive->size, POSIX_MADV_SEQUENTIAL);
+
+    while (pos < end) {
+        uint32_t bin_size = hbinSize(hive, pos);
+        if (!bin_size) {
+            rv_writeFmt(out, "WARN: bad hbin header at 0x%zx\n", pos);
+            pos = nextHbin(hive, pos, end);
+            clean = 0;
+            continue;
+        }
+        idx->nbins++;
+
+        size_t cell = pos + sizeof(BlockHeader);
+        size_t bin_end = pos + bin_size;
+        while (cell + sizeof(int32_t) <= bin_end) {
+            int32_t cell_size;
+            memcpy(&cell_size, hive->base + cell, sizeof(cell_size));
+
+            // Allocated cells have a negative size, free ones positive
+            int free_cell = cell_size > 0;
+            uint32_t len = free_cell ? (uint32_t) cell_size : -(uint32_t) cell_size;
+            if (len < 8 || len % 8 || len > bin_end - cell) {
+                rv_writeFmt(out, "WARN: bad cell size %d at 0x%zx\n", cell_size, cell);
+                clean = 0;
+                break;
+            }
+
+            int type = CELL_DATA;
+            if (len >= sizeof(int32_t) + 2)
+                type = classifyCell((const char *) hive->base + cell + sizeof(int32_t));
+            addCell(idx, cell - 0x1000, type | (free_cell ? CELL_FREE : 0));
+            cell += len;
+        }
+        pos = bin_end;
+    }
+    return clean;
+}
+
+// Sweep the hive and print how many cells of each type it holds
+void rv_printSweep(Hive *hive, Writer *out) {
+    CellIndex idx;
+    uint32_t used[NUM_CELL_TYPES] = { 0 }, freed[NUM_CELL_TYPES] = { 0 };
+    uint64_t used_bytes[NUM_CELL_TYPES] = { 0 }, free_bytes[NUM_CELL_TYPES] = { 0 };
+
+    sweepHive(hive, &idx, out);
+    for (uint32_t i = 0; i < idx.count; i++) {
+        int32_t cell_size;
+        memcpy(&cell_size, hive->base + 0x1000 + idx.offsets[i], sizeof(cell_size));
+        int type = idx.types[i] & ~CELL_FREE;
+        if (idx.types[i] & CELL_FREE) {
+            freed[type]++;
+            free_bytes[type] += cell_size;
+        }
+        else {
+            used[type]++;
+            used_bytes[type] -= cell_size;
+        }
+    }
+
+    rv_writeFmt(out, "%u hbins, %u cells\n", idx.nbins, idx.count);
+    rv_writeFmt(out, "type  allocated       bytes      free       bytes\n");
+    for (int t = 0; t < NUM_CELL_TYPES; t++) {
+        rv_writeFmt(out, "%-4s %10u %11llu %9u %11llu\n", cellTypeNames[t],
+            used[t], (unsigned long long) used_bytes[t],
+            freed[t], (unsigned long long) free_bytes[t]);
+    }
+    freeCellIndex(&idx);
+}
+
+// Carving: deleted keys and values survive in free cells until the
+// space is reused, so free cells, and whatever is left of an hbin after
+// a damaged cell, are scanned for nk and vk records. Anything found has
+// to look sane and, for keys, have a parent offset that is the start
+// of an nk cell (live or free) according to the sweep's cell index.
+// Each hbin is carved on its own, so -j spreads them over threads and
+// the output is put back together in hive order.
+
+typedef struct carver {
+    Hive *hive;
+    const CellIndex *idx;
+    Arena arena;
+    uint32_t nkeys;
+    uint32_t nvalues;
+} Carver;
+
+static void initCarver(Carver *c, Hive *hive, const CellIndex *idx) {
+    memset(c, 0, sizeof(*c));
+    c->hive = hive;
+    c->idx = idx;
+    initArena(&c->arena);
+}
+
+static void freeCarver(Carver *c) {
+    freeArena(&c->arena);
+}
+
+// Could this be a name, with no control characters in it?
+static int plausibleName(const char *name, uint32_t len, int compressed) {
+    if (compressed) {
+        for (uint32_t i = 0; i < len; i++) {
+            if ((unsigned char) name[i] < 0x20) return 0;
+        }
+        return 1;
+    }
+    if (len % 2) return 0;
+    for (uint32_t i = 0; i < len; i += 2) {
+        if (!name[i + 1] && (unsigned char) name[i] < 0x20) return 0;
+    }
+    return 1;
+}
+
+// The nk record in the slot at file offset pos, if it fits before end
+// and looks like a real key
+static const NK *carveNK(Carver *c, size_t pos, size_t end) {
+    const NK *nk = (const NK *) (c->hive->base + pos + sizeof(int32_t));
+    size_t room = end - pos - sizeof(int32_t);
+
+    if (room < offsetof(NK, name) || !nk->name_len || nk->name_len > 255 ||
+        nk->name_len > room - offsetof(NK, name) || nk->num_subkeys < 0 || nk->num_values < 0)
+        return NULL;
+    int parent = cellType(c->idx, nk->parent);
+    if (parent < 0 || (parent & ~CELL_FREE) != CELL_NK || nk->parent == pos - 0x1000)
+        return NULL;
+    return plausibleName(nk->name, nk->name_len, nk->type & NK_COMP_NAME) ? nk : NULL;
+}
+
+static const VK *carveVK(Carver *c, size_t pos, size_t end) {
+    const VK *vk = (const VK *) (c->hive->base + pos + sizeof(int32_t));
+    size_t room = end - pos - sizeof(int32_t);
+
+    if (room < offsetof(VK, name) || vk->name_len > room - offsetof(VK, name) ||
+        vk->type > REG_QWORD || !plausibleName(vk->name, vk->name_len, vk->flags & VK_COMP_NAME))
+        return NULL;
+    uint32_t len = vk->data_len & ~VK_DATA_INLINE;
+    if (vk->data_len & VK_DATA_INLINE) {
+        if (len > sizeof(vk->data_off)) return NULL;
+    }
+    else if (len && cellType(c->idx, vk->data_off) < 0) {
+        return NULL;
+    }
+    return vk;
+}
+
+// Write the path of a carved key, found by following parent links up
+// to the root through live and deleted keys alike
+static void writeCarvedPath(Carver *c, const NK *key, Writer *out) {
+    const NK *chain[KEY_MAX_DEPTH];
+    int depth = 0;
+
+    chain[depth++] = key;
+    while (depth < KEY_MAX_DEPTH && key->type != NK_ROOT &&
+        (key = getNK(c->hive, key->parent))) {
+        chain[depth++] = key;
+    }
+    if (chain[depth - 1]->type != NK_ROOT) rv_writeStr(out, "?\\");
+    while (depth-- > 0) {
+        writeName(out, chain[depth]->name, chain[depth]->name_len, chain[depth]->type & NK_COMP_NAME);
+        if (depth) writeChar(out, '\\');
+    }
+}
+
+static void writeCarvedTime(const FILETIME *ft, Writer *out) {
+    uint64_t ticks = ((uint64_t)ft->dwHighDateTime << 32) | ft->dwLowDateTime;
+    time_t unix_time = WindowsTickToUnixSeconds(ticks);
+    struct tm tm;
+    char buf[32];
+
+    if (!gmtime_r(&unix_time, &tm) || !strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm))
+        strcpy(buf, "?");
+    rv_writeStr(out, buf);
+}
+
+// Carve the unallocated space between file offsets start and end
+static void carveRange(Carver *c, size_t start, size_t end, Writer *out) {
+    int type;
+
+    for (size_t pos = start; (pos = findSignature(c->hive->base, pos, end,
+        SIG_NK | SIG_VK, &type)) < end; pos += 8) {
+        if (type == SIG_NK) {
+            const NK *nk = carveNK(c, pos, end);
+            if (!nk) continue;
+            rv_writeFmt(out, "nk 0x%zx ", pos - 0x1000);
+            writeCarvedTime(&nk->modified, out);
+            writeChar(out, ' ');
+            writeCarvedPath(c, nk, out);
+            writeChar(out, '\n');
+            c->nkeys++;
+        }
+        else {
+            const VK *vk = carveVK(c, pos, end);
+            if (!vk) continue;
+            ArenaMark mark = arenaMark(&c->arena);
+            rv_writeFmt(out, "vk 0x%zx ", pos - 0x1000);
+            printVK(vk, c->hive, &c->arena, 0, out);
+            arenaRelease(&c->arena, mark);
+            c->nvalues++;
+        }
+    }
+}
+
+// Carve the free cells and unparsed slack of the hbin at pos
+static void carveHbin(Carver *c, size_t pos, Writer *out) {
+    const CellIndex *idx = c->idx;
+    size_t bin_end = pos + hbinSize(c->hive, pos);
+    size_t gap = pos + sizeof(BlockHeader);
+
+    // The index is sorted, so this hbin's cells are a contiguous run
+    uint32_t lo = 0, hi = idx->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (idx->offsets[mid] + (size_t) 0x1000 < gap) lo = mid + 1;
+        else hi = mid;
+    }
+    for (uint32_t i = lo; i < idx->count && idx->offsets[i] + (size_t) 0x1000 < bin_end; i++) {
+        if (idx->types[i] & CELL_FREE) continue;
+        size_t cell = idx->offsets[i] + (size_t) 0x1000;
+        int32_t cell_size;
+        memcpy(&cell_size, c->hive->base + cell, sizeof(cell_size));
+        if (cell > gap) carveRange(c, gap, cell, out);
+        gap = cell + -(uint32_t) cell_size;
+    }
+    if (gap < bin_end) carveRange(c, gap, bin_end, out);
+}
+
+// A run of hbins carved by one thread into memory
+typedef struct carveChunk {
+    uint32_t first;
+    uint32_t count;
+    Writer out;
+    int done;
+} CarveChunk;
+
+typedef struct parallelCarve {
+    Hive *hive;
+    const CellIndex *idx;
+    const size_t *bins;
+    CarveChunk *chunks;
+    int nchunks;
+    int taken;
+    int next;               // the chunk the writer is waiting on
+    uint32_t nkeys;
+    uint32_t nvalues;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ParallelCarve;
+
+static void *carveWorker(void *arg) {
+    ParallelCarve *pc = (ParallelCarve *) arg;
+    Carver c;
+
+    initCarver(&c, pc->hive, pc->idx);
+    while (1) {
+        pthread_mutex_lock(&pc->lock);
+        int i = pc->taken++;
+        pthread_mutex_unlock(&pc->lock);
+        if (i >= pc->nchunks) break;
+
+        CarveChunk *ch = &pc->chunks[i];
+        rv_initWriter(&ch->out, NULL, NULL);
+        for (uint32_t b = ch->first; b < ch->first + ch->count; b++)
+            carveHbin(&c, pc->bins[b], &ch->out);
+
+        pthread_mutex_lock(&pc->lock);
+        ch->done = 1;
+        if (pc->next == i) pthread_cond_signal(&pc->cond);
+        pthread_mutex_unlock(&pc->lock);
+    }
+
+    pthread_mutex_lock(&pc->lock);
+    pc->nkeys += c.nkeys;
+    pc->nvalues += c.nvalues;
+    pthread_mutex_unlock(&pc->lock);
+    freeCarver(&c);
+    rv_mergeStats();
+    return NULL;
+}
+
+// Sweep the hive, then carve deleted keys and values out of its free
+// space using nthreads threads, printing them in hive order
+void rv_printCarve(Hive *hive, int nthreads, Writer *out) {
+    CellIndex idx;
+    size_t *bins = NULL;
+    uint32_t nbins = 0, cap = 0, nkeys, nvalues;
+
+    sweepHive(hive, &idx, out);
+
+    // The sweep has already warned about any damaged hbins
+    const HiveHeader *hdr = (const HiveHeader *) hive->base;
+    size_t end = hive->size;
+    if (hdr->last_block && 0x1000 + (size_t) hdr->last_block < end)
+        end = 0x1000 + (size_t) hdr->last_block;
+    for (size_t pos = 0x1000; pos < end; ) {
+        uint32_t bin_size = hbinSize(hive, pos);
+        if (!bin_size) {
+            pos = nextHbin(hive, pos, end);
+            continue;
+        }
+        if (nbins == cap) {
+            cap = cap ? cap * 2 : 256;
+            bins = (size_t *) realloc(bins, cap * sizeof(size_t));
+            if (!bins) exit(1);
+        }
+        bins[nbins++] = pos;
+        pos += bin_size;
+    }
+
+    if (nthreads <= 1) {
+        Carver c;
+        initCarver(&c, hive, &idx);
+        for (uint32_t b = 0; b < nbins; b++)
+            carveHbin(&c, bins[b], out);
+        nkeys = c.nkeys;
+        nvalues = c.nvalues;
+        freeCarver(&c);
+    }
+    else {
+        ParallelCarve pc;
+        pc.hive = hive;
+        pc.idx = &idx;
+        pc.bins = bins;
+        pc.nchunks = nbins < (uint32_t) nthreads * 16 ? nbins : (uint32_t) nthreads * 16;
+        pc.taken = pc.next = 0;
+        pc.nkeys = pc.nvalues = 0;
+        pc.chunks = (CarveChunk *) calloc(pc.nchunks ? pc.nchunks : 1, sizeof(CarveChunk));
+        pthread_t *threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+        if (!pc.chunks || !threads) exit(1);
+        for (int i = 0; i < pc.nchunks; i++) {
+            pc.chunks[i].first = (uint64_t) nbins * i / pc.nchunks;
+            pc.chunks[i].count = (uint64_t) nbins * (i + 1) / pc.nchunks - pc.chunks[i].first;
+        }
+        pthread_mutex_init(&pc.lock, NULL);
+        pthread_cond_init(&pc.cond, NULL);
+        for (int t = 0; t < nthreads; t++) {
+            if (pthread_create(&threads[t], NULL, carveWorker, &pc)) {
+                perror("pthread_create");
+                exit(1);
+            }
+        }
+
+        // Write chunks out in hive order as they complete
+        for (int i = 0; i < pc.nchunks; i++) {
+            pthread_mutex_lock(&pc.lock);
+            pc.next = i;
+            while (!pc.chunks[i].done) pthread_cond_wait(&pc.cond, &pc.lock);
+            pthread_mutex_unlock(&pc.lock);
+            rv_writeBytes(out, pc.chunks[i].out.buf, pc.chunks[i].out.len);
+            rv_freeWriter(&pc.chunks[i].out);
+        }
+
+        for (int t = 0; t < nthreads; t++) {
+            pthread_join(threads[t], NULL);
+        }
+        pthread_mutex_destroy(&pc.lock);
+        pthread_cond_destroy(&pc.cond);
+        nkeys = pc.nkeys;
+        nvalues = pc.nvalues;
+        free(threads);
+        free(pc.chunks);
+    }
+
+    rv_writeFmt(out, "%u deleted keys, %u deleted values recovered\n", nkeys, nvalues);
+    free(bins);
+    freeCellIndex(&idx);
+}
+
+// Verification: --verify checks the structure of the whole hive up
+// front, so that damaged evidence is turned away in seconds rather
+// than part of the way through a long walk. The chain of hbin headers
+// is followed first. Then each hbin's cells are checked to add up and
+// put in a cell index, and after that every allocated key, subkey
+// list, value, big data and security record has its offsets checked
+// against the index: each has to be the start of an allocated cell of
+// the right type. Both of the latter passes take an hbin at a time,
+// spread over -j threads.
+//
+// Data cells have no signature, so anything allocated will do where
+// data is expected, and some data is bound to start with something
+// that looks like one. So before any cell is checked, the cells that
+// keys and values point to as data are marked, and aren't checked as
+// the records they look like.
+#define CELL_BIT(t) (1u << (t))
+#define ANY_CELL 0xffffffffu
+#define SUBKEY_LIST (CELL_BIT(CELL_LF) | CELL_BIT(CELL_LH) | CELL_BIT(CELL_LI) | CELL_BIT(CELL_RI))
+
+// A run of hbins checked by one thread, with what it found
+typedef struct verifyChunk {
+    uint32_t first;
+    uint32_t count;
+    CellIndex cells;        // of these hbins, from the first pass
+    uint32_t start;         // where they begin in the whole index
+    Writer out;
+    uint64_t problems;
+} VerifyChunk;
+
+typedef struct verifier {
+    Hive *hive;
+    const size_t *bins;     // file offsets of the good hbins
+    const uint32_t *sizes;
+    VerifyChunk *chunks;
+    int nchunks;
+    int pass;
+    int taken;
+    CellIndex idx;          // every cell, once the first pass is done
+    unsigned char *as_data; // per cell in idx: pointed to as data
+    pthread_mutex_t lock;
+} Verifier;
+
+// Check that target is an allocated cell of one of the types in mask.
+// Problems are described as "<what> 0x<target> of the <type> at <from>".
+// Return value: 1 if it is, 0 if not.
+static int checkRef(const Verifier *v, VerifyChunk *ch, uint32_t from, const char *from_name,
+        const char *what, uint32_t target, uint32_t mask) {
+    int type = cellType(&v->idx, target);
+    if (type >= 0 && !(type & CELL_FREE) && (mask & CELL_BIT(type))) return 1;
+
+    rv_writeFmt(&ch->out, "%s 0x%x of the %s at 0x%x ", what, target, from_name, from);
+    if (type < 0) rv_writeStr(&ch->out, "is not the start of a cell\n");
+    else rv_writeFmt(&ch->out, "is a %s%s cell\n", type & CELL_FREE ? "free " : "",
+        cellTypeNames[type & ~CELL_FREE]);
+    ch->problems++;
+    return 0;
+}
+
+// Length of the cell at off, which the index says is allocated
+static uint32_t verifiedCellLen(const Verifier *v, uint32_t off) {
+    int32_t cell_size;
+    memcpy(&cell_size, v->hive->base + 0x1000 + off, sizeof(cell_size));
+    return -(uint32_t) cell_size - sizeof(int32_t);
+}
+
+// Check that an allocated cell has room for len bytes of the record in it
+static int checkRoom(const Verifier *v, VerifyChunk *ch, uint32_t off, int type, size_t len) {
+    if (len <= verifiedCellLen(v, off)) return 1;
+    rv_writeFmt(&ch->out, "%s at 0x%x does not fit in its cell\n", cellTypeNames[type], off);
+    ch->problems++;
+    return 0;
+}
+
+// Check a list of n offsets held in the cell at list, each of which
+// should be a cell of a type in mask
+static void checkOffsetList(const Verifier *v, VerifyChunk *ch, uint32_t from, int from_type,
+        const char *what, uint32_t list, uint32_t n, uint32_t mask) {
+    if (!checkRef(v, ch, from, cellTypeNames[from_type], what, list, ANY_CELL)) return;
+    if (n * (uint64_t) sizeof(uint32_t) > verifiedCellLen(v, list)) {
+        rv_writeFmt(&ch->out, "%s 0x%x of the %s at 0x%x is too short for %u entries\n",
+            what, list, cellTypeNames[from_type], from, n);
+        ch->problems++;
+        return;
+    }
+    const uint32_t *entries = (const uint32_t *) (v->hive->base + convOff(list));
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t off;
+        memcpy(&off, entries + i, sizeof(off));
+        checkRef(v, ch, list, what, "entry", off, mask);
+    }
+}
+
+// Mark the cell at off as being used for data, if there is one there
+static void markData(Verifier *v, uint32_t off) {
+    int64_t i = findCell(&v->idx, off);
+    if (i >= 0) __atomic_store_n(&v->as_data[i], 1, __ATOMIC_RELAXED);
+}
+
+// Mark whatever one allocated cell points to as data
+static void markCellData(Verifier *v, uint32_t off, int type) {
+    const unsigned char *p = v->hive->base + convOff(off);
+    uint32_t room = verifiedCellLen(v, off);
+
+    if (type == CELL_NK && room >= offsetof(NK, name)) {
+        const NK *key = (const NK *) p;
+        if (key->num_values > 0) markData(v, key->values);
+        if (key->classname_len) markData(v, key->classname);
+    }
+    else if (type == CELL_VK && room >= offsetof(VK, name)) {
+        const VK *vk = (const VK *) p;
+        if (!(vk->data_len & VK_DATA_INLINE) && vk->data_len &&
+            (vk->data_len <= DB_SEGMENT_SIZE || cellType(&v->idx, vk->data_off) != CELL_DB))
+            markData(v, vk->data_off);
+    }
+    else if (type == CELL_DB && room >= sizeof(DB)) {
+        const DB *db = (const DB *) p;
+        int64_t list = findCell(&v->idx, db->segments);
+        if (list < 0 || (v->idx.types[list] & CELL_FREE)) return;
+        markData(v, db->segments);
+        if (db->num_segments * (uint64_t) sizeof(uint32_t) > verifiedCellLen(v, db->segments))
+            return;
+        const uint32_t *segments = (const uint32_t *) (v->hive->base + convOff(db->segments));
+        for (uint32_t i = 0; i < db->num_segments; i++) {
+            uint32_t seg;
+            memcpy(&seg, segments + i, sizeof(seg));
+            markData(v, seg);
+        }
+    }
+}
+
+// Check that each key in the subkey list at list, or in the lists it
+// holds if it's an ri list, names the nk at owner as its parent, and
+// isn't the root. A list that points back up the tree would otherwise
+// send a walk round for ever. Entries that aren't nk cells are left to
+// the list's own check.
+static void checkSubkeyParents(const Verifier *v, VerifyChunk *ch, uint32_t owner, uint32_t list) {
+    const unsigned char *p = v->hive->base + convOff(list);
+    const LH *lh = (const LH *) p;
+    uint32_t root = ((const HiveHeader *) v->hive->base)->data_offset;
+    int type = cellType(&v->idx, list);
+    int stride = type == CELL_LF || type == CELL_LH ? sizeof(HashRec) : sizeof(uint32_t);
+
+    if (lh->num_entries < 0 ||
+        sizeof(LH) + (size_t) lh->num_entries * stride > verifiedCellLen(v, list))
+        return;
+    for (int i = 0; i < lh->num_entries; i++) {
+        uint32_t entry;
+        memcpy(&entry, p + sizeof(LH) + i * stride, sizeof(entry));
+        int entry_type = cellType(&v->idx, entry);
+        if (type == CELL_RI) {
+            if (entry_type == CELL_LF || entry_type == CELL_LH || entry_type == CELL_LI)
+                checkSubkeyParents(v, ch, owner, entry);
+            continue;
+        }
+        if (entry_type != CELL_NK || verifiedCellLen(v, entry) < offsetof(NK, name))
+            continue;
+        const NK *key = (const NK *) (v->hive->base + convOff(entry));
+        if (entry == root) {
+            rv_writeFmt(&ch->out, "root key 0x%x is listed as a subkey of the nk at 0x%x\n",
+                entry, owner);
+            ch->problems++;
+        }
+        else if (key->parent != owner) {
+            rv_writeFmt(&ch->out, "nk at 0x%x is listed under the nk at 0x%x, but its parent is 0x%x\n",
+                entry, owner, key->parent);
+            ch->problems++;
+        }
+    }
+}
+
+// Check the offsets in one allocated cell
+static void verifyCell(const Verifier *v, VerifyChunk *ch, uint32_t off, int type) {
+    const unsigned char *p = v->hive->base + convOff(off);
+
+    if (type == CELL_NK) {
+        const NK *key = (const NK *) p;
+        if (!checkRoom(v, ch, off, type, offsetof(NK, name) + (size_t) key->name_len)) return;
+        if (key->type != NK_ROOT)
+            checkRef(v, ch, off, cellTypeNames[type], "parent", key->parent, CELL_BIT(CELL_NK));
+        if (key->num_subkeys < 0 || key->num_values < 0) {
+            rv_writeFmt(&ch->out, "nk at 0x%x has %d subkeys and %d values\n",
+                off, key->num_subkeys, key->num_values);
+            ch->problems++;
+            return;
+        }
+        if (key->num_subkeys &&
+            checkRef(v, ch, off, cellTypeNames[type], "subkey list", key->subkeys, SUBKEY_LIST))
+            checkSubkeyParents(v, ch, off, key->subkeys);
+        if (key->num_values)
+            checkOffsetList(v, ch, off, type, "value list", key->values,
+                key->num_values, CELL_BIT(CELL_VK));
+        if (key->security != 0xFFFFFFFF)
+            checkRef(v, ch, off, cellTypeNames[type], "security descriptor", key->security, CELL_BIT(CELL_SK));
+        if (key->classname_len)
+            checkRef(v, ch, off, cellTypeNames[type], "class name", key->classname, ANY_CELL);
+    }
+    else if (type == CELL_LF || type == CELL_LH || type == CELL_LI || type == CELL_RI) {
+        const LH *list = (const LH *) p;
+        int stride = type == CELL_LF || type == CELL_LH ? sizeof(HashRec) : sizeof(uint32_t);
+        if (list->num_entries < 0 ||
+            !checkRoom(v, ch, off, type, sizeof(LH) + (size_t) list->num_entries * stride))
+            return;
+        uint32_t mask = type == CELL_RI ? SUBKEY_LIST & ~CELL_BIT(CELL_RI) : CELL_BIT(CELL_NK);
+        for (int i = 0; i < list->num_entries; i++) {
+            uint32_t entry;
+            memcpy(&entry, p + sizeof(LH) + i * stride, sizeof(entry));
+            checkRef(v, ch, off, cellTypeNames[type], "entry", entry, mask);
+        }
+    }
+    else if (type == CELL_VK) {
+        const VK *vk = (const VK *) p;
+        if (!checkRoom(v, ch, off, type, offsetof(VK, name) + (size_t) vk->name_len)) return;
+        uint32_t len = vk->data_len & ~VK_DATA_INLINE;
+        if (vk->data_len & VK_DATA_INLINE) {
+            if (len > sizeof(vk->data_off)) {
+                rv_writeFmt(&ch->out, "vk at 0x%x has %u bytes of inline data\n", off, len);
+                ch->problems++;
+            }
+        }
+        else if (len && checkRef(v, ch, off, cellTypeNames[type], "data", vk->data_off, ANY_CELL) &&
+            cellType(&v->idx, vk->data_off) != CELL_DB && len > verifiedCellLen(v, vk->data_off)) {
+            rv_writeFmt(&ch->out, "data 0x%x of the vk at 0x%x is too short for %u bytes\n",
+                vk->data_off, off, len);
+            ch->problems++;
+        }
+    }
+    else if (type == CELL_DB) {
+        const DB *db = (const DB *) p;
+        if (checkRoom(v, ch, off, type, sizeof(DB)))
+            checkOffsetList(v, ch, off, type, "segment list", db->segments,
+                db->num_segments, ANY_CELL);
+    }
+    else if (type == CELL_SK) {
+        const SK *sk = (const SK *) p;
+        if (checkRoom(v, ch, off, type, offsetof(SK, descriptor) + (size_t) sk->descriptor_len)) {
+            checkRef(v, ch, off, cellTypeNames[type], "next", sk->next, CELL_BIT(CELL_SK));
+            checkRef(v, ch, off, cellTypeNames[type], "previous", sk->prev, CELL_BIT(CELL_SK));
+        }
+    }
+}
+
+// First pass over an hbin: its cells must add up to exactly fill it
+static void indexVerifiedHbin(Verifier *v, VerifyChunk *ch, uint32_t b) {
+    size_t pos = v->bins[b];
+    size_t cell = pos + sizeof(BlockHeader);
+    size_t bin_end = pos + v->sizes[b];
+
+    while (cell < bin_end) {
+        int32_t cell_size;
+        memcpy(&cell_size, v->hive->base + cell, sizeof(cell_size));
+        int free_cell = cell_size > 0;
+        uint32_t len = free_cell ? (uint32_t) cell_size : -(uint32_t) cell_size;
+        if (len < 8 || len % 8 || len > bin_end - cell) {
+            rv_writeFmt(&ch->out, "bad cell size %d at 0x%zx in the hbin at 0x%zx\n",
+                cell_size, cell - 0x1000, pos - 0x1000);
+            ch->problems++;
+            return;
+        }
+        int type = CELL_DATA;
+        if (len >= sizeof(int32_t) + 2)
+            type = classifyCell((const char *) v->hive->base + cell + sizeof(int32_t));
+        addCell(&ch->cells, cell - 0x1000, type | (free_cell ? CELL_FREE : 0));
+        cell += len;
+    }
+}
+
+static void *verifyWorker(void *arg) {
+    Verifier *v = (Verifier *) arg;
+
+    while (1) {
+        pthread_mutex_lock(&v->lock);
+        int i = v->taken++;
+        pthread_mutex_unlock(&v->lock);
+        if (i >= v->nchunks) break;
+
+        VerifyChunk *ch = &v->chunks[i];
+        if (v->pass == 0) {
+            for (uint32_t b = ch->first; b < ch->first + ch->count; b++)
+                indexVerifiedHbin(v, ch, b);
+        }
+        else {
+            for (uint32_t c = ch->start; c < ch->start + ch->cells.count; c++) {
+                if (v->idx.types[c] & CELL_FREE) continue;
+                if (v->pass == 1)
+                    markCellData(v, v->idx.offsets[c], v->idx.types[c]);
+                else if (!v->as_data[c])
+                    verifyCell(v, ch, v->idx.offsets[c], v->idx.types[c]);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Run one pass over every chunk, on nthreads threads
+static void runVerifyPass(Verifier *v, int pass, int nthreads) {
+    v->pass = pass;
+    v->taken = 0;
+    if (nthreads <= 1) {
+        verifyWorker(v);
+        return;
+    }
+    pthread_t *threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+    if (!threads) exit(1);
+    for (int t = 0; t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, verifyWorker, v)) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+}
+
+// Check the hbin headers in order: each must say where it is and how
+// big it is, and the last must end where the base block says the
+// hbins do. Return value: the good hbins, in *bins and *sizes.
+static uint32_t findVerifiedHbins(Hive *hive, size_t **bins, uint32_t **sizes,
+        uint64_t *problems, Writer *out) {
+    const HiveHeader *hdr = (const HiveHeader *) hive->base;
+    size_t end = 0x1000 + (size_t) hdr->last_block;
+    uint32_t n = 0, cap = 0;
+
+    *bins = NULL;
+    *sizes = NULL;
+    if (end > hive->size) {
+        rv_writeFmt(out, "hbins should end at 0x%zx, past the end of the file at 0x%zx\n",
+            end, hive->size);
+        (*problems)++;
+        end = hive->size;
+    }
+    size_t pos = 0x1000;
+    while (pos < end) {
+        const BlockHeader *bh = (const BlockHeader *) (hive->base + pos);
+        uint32_t bin_size = hbinSize(hive, pos);
+        if (!bin_size) {
+            rv_writeFmt(out, "bad hbin header at 0x%zx\n", pos - 0x1000);
+            (*problems)++;
+            pos = nextHbin(hive, pos, end);
+            continue;
+        }
+        if (bh->off != pos - 0x1000) {
+            rv_writeFmt(out, "hbin at 0x%zx says it is at 0x%x\n", pos - 0x1000, bh->off);
+            (*problems)++;
+        }
+        if (bh->next && bh->block_size && bh->next != bh->block_size) {
+            rv_writeFmt(out, "hbin at 0x%zx has sizes 0x%x and 0x%x\n", pos - 0x1000,
+                bh->next, bh->block_size);
+            (*problems)++;
+        }
+        if (pos + bin_size > end) {
+            rv_writeFmt(out, "hbin at 0x%zx runs past the end of the hbins\n", pos - 0x1000);
+            (*problems)++;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 256;
+            *bins = (size_t *) realloc(*bins, cap * sizeof(size_t));
+            *sizes = (uint32_t *) realloc(*sizes, cap * sizeof(uint32_t));
+            if (!*bins || !*sizes) exit(1);
+        }
+        (*bins)[n] = pos;
+        (*sizes)[n++] = bin_size;
+        pos += bin_size;
+    }
+    return n;
+}
+
+// Check the whole hive, using nthreads threads, and print what's wrong
+// with it. Return value: 1 if nothing is, 0 if something is.
+int rv_printVerify(Hive *hive, int nthreads, Writer *out) {
+    const HiveHeader *hdr = (const HiveHeader *) hive->base;
+    Verifier v;
+    size_t *bins;
+    uint32_t *sizes;
+    uint64_t problems = 0;
+
+    memset(&v, 0, sizeof(v));
+    uint32_t nbins = findVerifiedHbins(hive, &bins, &sizes, &problems, out);
+    v.hive = hive;
+    v.bins = bins;
+    v.sizes = sizes;
+    v.nchunks = nbins < (uint32_t) nthreads * 16 ? nbins : (uint32_t) nthreads * 16;
+    v.chunks = (VerifyChunk *) calloc(v.nchunks ? v.nchunks : 1, sizeof(VerifyChunk));
+    if (!v.chunks) exit(1);
+    for (int i = 0; i < v.nchunks; i++) {
+        v.chunks[i].first = (uint64_t) nbins * i / v.nchunks;
+        v.chunks[i].count = (uint64_t) nbins * (i + 1) / v.nchunks - v.chunks[i].first;
+        rv_initWriter(&v.chunks[i].out, NULL, NULL);
+    }
+    pthread_mutex_init(&v.lock, NULL);
+
+    // Index the cells of each hbin, then put the chunks' indexes
+    // together, and what they found wrong, in hive order
+    runVerifyPass(&v, 0, nthreads);
+    for (int i = 0; i < v.nchunks; i++) {
+        VerifyChunk *ch = &v.chunks[i];
+        rv_writeBytes(out, ch->out.buf, ch->out.len);
+        ch->out.len = 0;
+        ch->start = v.idx.count;
+        for (uint32_t c = 0; c < ch->cells.count; c++)
+            addCell(&v.idx, ch->cells.offsets[c], ch->cells.types[c]);
+    }
+
+    if (cellType(&v.idx, hdr->data_offset) != CELL_NK ||
+        ((const NK *) (hive->base + convOff(hdr->data_offset)))->type != NK_ROOT) {
+        rv_writeFmt(out, "root key 0x%x is not an allocated root nk cell\n", hdr->data_offset);
+        problems++;
+    }
+
+    v.as_data = (unsigned char *) calloc(v.idx.count ? v.idx.count : 1, 1);
+    if (!v.as_data) exit(1);
+    runVerifyPass(&v, 1, nthreads);
+    runVerifyPass(&v, 2, nthreads);
+    for (int i = 0; i < v.nchunks; i++) {
+        VerifyChunk *ch = &v.chunks[i];
+        rv_writeBytes(out, ch->out.buf, ch->out.len);
+        problems += ch->problems;
+        rv_freeWriter(&ch->out);
+        freeCellIndex(&ch->cells);
+    }
+
+    rv_writeFmt(out, "%u hbins, %u cells checked, %llu problems found\n",
+        nbins, v.idx.count, (unsigned long long) problems);
+    pthread_mutex_destroy(&v.lock);
+    freeCellIndex(&v.idx);
+    free(v.as_data);
+    free(v.chunks);
+    free(bins);
+    free(sizes);
+    return problems == 0;
+}
+
+static uint32_t hashName(const char *name, uint32_t len) {
+    uint32_t h = 2166136261u;
+    for (uint32_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) name[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void initNameTable(NameTable *nt) {
+    memset(nt, 0, sizeof(*nt));
+    nt->offsets_cap = 1024;
+    nt->offsets = (uint32_t *) malloc(nt->offsets_cap * sizeof(uint32_t));
+    nt->nslots = 2048;
+    nt->slots = (uint32_t *) calloc(nt->nslots, sizeof(uint32_t));
+    if (!nt->offsets || !nt->slots) exit(1);
+    nt->offsets[0] = 0;
+}
+
+static void freeNameTable(NameTable *nt) {
+    free(nt->chars);
+    free(nt->offsets);
+    free(nt->slots);
+    memset(nt, 0, sizeof(*nt));
+}
+
+static const char *nameChars(const NameTable *nt, uint32_t id, uint32_t *len) {
+    *len = nt->offsets[id + 1] - nt->offsets[id];
+    return nt->chars + nt->offsets[id];
+}
+
+// Return the id of name, adding it to the table if it's new
+static uint32_t internName(NameTable *nt, const char *name, uint32_t len) {
+    uint32_t mask = nt->nslots - 1;
+    uint32_t slot = hashName(name, len) & mask;
+
+    while (nt->slots[slot]) {
+        uint32_t id = nt->slots[slot] - 1, id_len;
+        const char *chars = nameChars(nt, id, &id_len);
+        if (id_len == len && !memcmp(chars, name, len)) return id;
+        slot = (slot + 1) & mask;
+    }
+
+    if (!nt->chars || nt->chars_len + len > nt->chars_cap) {
+        while (!nt->chars_cap || nt->chars_len + len > nt->chars_cap)
+            nt->chars_cap = nt->chars_cap ? nt->chars_cap * 2 : 65536;
+        nt->chars = (char *) realloc(nt->chars, nt->chars_cap);
+        if (!nt->chars) exit(1);
+    }
+    if (nt->count + 2 > nt->offsets_cap) {
+        nt->offsets_cap *= 2;
+        nt->offsets = (uint32_t *) realloc(nt->offsets, nt->offsets_cap * sizeof(uint32_t));
+        if (!nt->offsets) exit(1);
+    }
+    memcpy(nt->chars + nt->chars_len, name, len);
+    nt->chars_len += len;
+    uint32_t id = nt->count++;
+    nt->offsets[nt->count] = nt->chars_len;
+    nt->slots[slot] = id + 1;
+
+    // Keep the hash at most half full
+    if (nt->count * 2 > nt->nslots) {
+        free(nt->slots);
+        nt->nslots *= 2;
+        nt->slots = (uint32_t *) calloc(nt->nslots, sizeof(uint32_t));
+        if (!nt->slots) exit(1);
+        mask = nt->nslots - 1;
+        for (uint32_t i = 0; i < nt->count; i++) {
+            uint32_t i_len;
+            const char *chars = nameChars(nt, i, &i_len);
+            slot = hashName(chars, i_len) & mask;
+            while (nt->slots[slot]) slot = (slot + 1) & mask;
+            nt->slots[slot] = i + 1;
+        }
+    }
+    return id;
+}
+
+void rv_freeKeyIndex(KeyIndex *idx) {
+    if (idx->map) {
+        munmap(idx->map, idx->map_size);
+        memset(&idx->names, 0, sizeof(idx->names));
+    }
+    else {
+        free(idx->keys);
+        freeNameTable(&idx->names);
+    }
+    idx->keys = NULL;
+    idx->count = idx->cap = 0;
+    idx->map = NULL;
+}
+
+// State for indexKeyVisitor: the key last seen at each level, which is
+// the parent of the next key one level down and the previous sibling
+// of the next key at the same level.
+typedef struct indexBuilder {
+    KeyIndex *idx;
+    uint32_t *path;
+    int path_cap;
+    Arena names;            // for decoding names on their way in
+} IndexBuilder;
+
+static void initIndexBuilder(IndexBuilder *b, KeyIndex *idx) {
+    b->idx = idx;
+    b->path = NULL;
+    b->path_cap = 0;
+    initArena(&b->names);
+    idx->keys = NULL;
+    idx->count = idx->cap = 0;
+    idx->map = NULL;
+    initNameTable(&idx->names);
+}
+
+static void freeIndexBuilder(IndexBuilder *b) {
+    free(b->path);
+    freeArena(&b->names);
+}
+
+// Add a key to the index as the next one in walk order, at level.
+// Return value: the key's index.
+static uint32_t addIndexKey(IndexBuilder *b, const char *name, size_t len, FILETIME modified,
+        int level) {
+    KeyIndex *idx = b->idx;
+
+    if (idx->count == idx->cap) {
+        idx->cap = idx->cap ? idx->cap * 2 : 4096;
+        idx->keys = (KeyEntry *) realloc(idx->keys, idx->cap * sizeof(KeyEntry));
+        if (!idx->keys) exit(1);
+    }
+    if (level >= b->path_cap) {
+        b->path_cap = b->path_cap ? b->path_cap * 2 : 64;
+        b->path = (uint32_t *) realloc(b->path, b->path_cap * sizeof(uint32_t));
+        if (!b->path) exit(1);
+    }
+
+    uint32_t i = idx->count++;
+    KeyEntry *e = &idx->keys[i];
+    e->parent = level ? b->path[level - 1] : NO_KEY;
+    e->first_child = NO_KEY;
+    e->next_sibling = NO_KEY;
+    e->name = internName(&idx->names, name, len);
+    e->modified = modified;
+
+    if (level) {
+        KeyEntry *parent = &idx->keys[e->parent];
+        if (parent->first_child == NO_KEY)
+            parent->first_child = i;
+        else
+            idx->keys[b->path[level]].next_sibling = i;
+    }
+    b->path[level] = i;
+    return i;
+}
+
+static int indexKeyVisitor(Hive *hive, const NK *key, int level, void *ctx) {
+    IndexBuilder *b = (IndexBuilder *) ctx;
+    ArenaMark mark = arenaMark(&b->names);
+    (void) hive;
+    size_t len;
+    const char *name = keyName(&b->names, key, &len);
+    addIndexKey(b, name, len, key->modified, level);
+    arenaRelease(&b->names, mark);
+    return WALK_DESCEND;
+}
+
+// Build a KeyIndex of root and everything below it
+void rv_buildKeyIndex(Hive *hive, const NK *root, KeyIndex *idx) {
+    IndexBuilder b;
+    Walker w;
+
+    initIndexBuilder(&b, idx);
+    initWalker(&w, &rv_output);
+    walkSubTree(&w, hive, root, 0, indexKeyVisitor, &b);
+    freeWalker(&w);
+    freeIndexBuilder(&b);
+}
+
+// Print key i of the index and its subtree, like rv_printSubTree does
+void rv_printIndexTree(const KeyIndex *idx, uint32_t i, Writer *out) {
+    uint32_t top = i;
+    int level = 0;
+
+    while (1) {
+        uint32_t len;
+        const char *name = nameChars(&idx->names, idx->keys[i].name, &len);
+        writeIndent(out, level);
+        rv_writeBytes(out, name, len);
+        writeChar(out, '\n');
+
+        // Next in walk order: first child, else the next sibling of
+        // the nearest ancestor (within the subtree) that has one
+        if (idx->keys[i].first_child != NO_KEY) {
+            i = idx->keys[i].first_child;
+            level++;
+            continue;
+        }
+        while (i != top && idx->keys[i].next_sibling == NO_KEY) {
+            i = idx->keys[i].parent;
+            level--;
+        }
+        if (i == top) break;
+        i = idx->keys[i].next_sibling;
+    }
+}
+
+void rv_printIndexStats(const KeyIndex *idx, Writer *out) {
+    // Parents come before children, so depths fill in in one pass
+    uint32_t *depth = (uint32_t *) malloc(idx->count * sizeof(uint32_t));
+    uint32_t max_depth = 0;
+    if (!depth) exit(1);
+    for (uint32_t i = 0; i < idx->count; i++) {
+        depth[i] = i ? depth[idx->keys[i].parent] + 1 : 0;
+        if (depth[i] > max_depth) max_depth = depth[i];
+    }
+    free(depth);
+
+    size_t key_bytes = (size_t) idx->count * sizeof(KeyEntry);
+    size_t name_bytes = idx->names.chars_len + (idx->names.count + 1) * sizeof(uint32_t);
+    rv_writeFmt(out, "%u keys, %u distinct names, max depth %u\n",
+        idx->count, idx->names.count, max_depth);
+    rv_writeFmt(out, "%zu bytes of keys, %zu bytes of names\n", key_bytes, name_bytes);
+}
+
+// Find the key at path in a KeyIndex, the same way rv_lookupKey does. Return value: the key's index,
+// or NO_KEY.
+uint32_t rv_lookupIndexKey(const KeyIndex *idx, const char *path) {
+    uint32_t i = 0;
+    const char *name;
+    size_t len;
+
+    while (nextComponent(&path, &name, &len)) {
+        for (i = idx->keys[i].first_child; i != NO_KEY; i = idx->keys[i].next_sibling) {
+            uint32_t i_len;
+            const char *chars = nameChars(&idx->names, idx->keys[i].name, &i_len);
+            if (!compareNames(chars, i_len, name, len)) break;
+        }
+        if (i == NO_KEY) break;
+    }
+    return i;
+}
+
+// Header of an index cache file. It is followed directly by the
+// index's arrays: count KeyEntries, name_count + 1 name offsets and
+// chars_len bytes of names, so a loaded cache can be used in place.
+// The hive fields say which state of the hive the index describes.
+#define INDEX_MAGIC "rvindex"
+#define INDEX_VERSION 2         // 2: names stored as UTF-8
+
+typedef struct indexFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t update_count1;
+    uint32_t update_count2;
+    FILETIME modified;
+    uint32_t checksum;
+    uint32_t last_block;
+    uint32_t count;
+    uint32_t name_count;
+    uint32_t chars_len;
+} IndexFileHeader;
+
+static void initIndexFileHeader(IndexFileHeader *ih, const HiveHeader *hdr) {
+    memset(ih, 0, sizeof(*ih));
+    memcpy(ih->magic, INDEX_MAGIC, sizeof(ih->magic));
+    ih->version = INDEX_VERSION;
+    ih->update_count1 = hdr->update_count1;
+    ih->update_count2 = hdr->update_count2;
+    ih->modified = hdr->modified;
+    ih->checksum = hdr->checksum;
+    ih->last_block = hdr->last_block;
+}
+
+// Write idx to path, tagged with the state of the hive it came from.
+// The file is written under a temporary name and renamed into place,
+// so a reader never sees a partial cache. Return value: 1 on success.
+int rv_saveKeyIndex(const KeyIndex *idx, const HiveHeader *hdr, const char *path) {
+    IndexFileHeader ih;
+    size_t tmp_len = strlen(path) + 8;
+    char *tmp = (char *) malloc(tmp_len);
+    if (!tmp) exit(1);
+    snprintf(tmp, tmp_len, "%s.tmp", path);
+
+    initIndexFileHeader(&ih, hdr);
+    ih.count = idx->count;
+    ih.name_count = idx->names.count;
+    ih.chars_len = idx->names.chars_len;
+
+    FILE *f = fopen(tmp, "wb");
+    if (!f) {
+        perror("fopen");
+        free(tmp);
+        return 0;
+    }
+    int ok = fwrite(&ih, sizeof(ih), 1, f) == 1 &&
+        fwrite(idx->keys, sizeof(KeyEntry), idx->count, f) == idx->count &&
+        fwrite(idx->names.offsets, sizeof(uint32_t), idx->names.count + 1, f) ==
+            idx->names.count + 1 &&
+        fwrite(idx->names.chars, 1, idx->names.chars_len, f) == idx->names.chars_len;
+    if (fclose(f)) ok = 0;
+    if (ok && rename(tmp, path)) {
+        perror("rename");
+        ok = 0;
+    }
+    if (!ok) unlink(tmp);
+    free(tmp);
+    return ok;
+}
+
+// Map the index cached at path, if there is one and it was made from
+// the hive as it is now. Return value: 1 if idx was loaded, else 0.
+int rv_loadKeyIndex(KeyIndex *idx, const HiveHeader *hdr, const char *path) {
+    IndexFileHeader want;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(IndexFileHeader)) {
+        close(fd);
+        return 0;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+
+    const IndexFileHeader *ih = (const IndexFileHeader *) map;
+    initIndexFileHeader(&want, hdr);
+    uint64_t size = sizeof(IndexFileHeader) + (uint64_t) ih->count * sizeof(KeyEntry) +
+        ((uint64_t) ih->name_count + 1) * sizeof(uint32_t) + ih->chars_len;
+    if (memcmp(ih, &want, offsetof(IndexFileHeader, count)) ||
+        size != (uint64_t) st.st_size || ih->count == 0) {
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    memset(idx, 0, sizeof(*idx));
+    idx->map = map;
+    idx->map_size = st.st_size;
+    idx->count = idx->cap = ih->count;
+    idx->keys = (KeyEntry *) (ih + 1);
+    idx->names.count = ih->name_count;
+    idx->names.chars_len = ih->chars_len;
+    idx->names.offsets = (uint32_t *) (idx->keys + ih->count);
+    idx->names.chars = (char *) (idx->names.offsets + ih->name_count + 1);
+
+    // Don't trust links or name ids that point outside the arrays, or
+    // links that lead backwards, which a walk could go round forever
+    if (idx->names.offsets[ih->name_count] != ih->chars_len) {
+        rv_freeKeyIndex(idx);
+        return 0;
+    }
+    for (uint32_t i = 0; i < ih->count; i++) {
+        const KeyEntry *e = &idx->keys[i];
+        if ((e->parent != NO_KEY && e->parent >= i) ||
+            (e->first_child != NO_KEY && (e->first_child <= i || e->first_child >= ih->count)) ||
+            (e->next_sibling != NO_KEY && (e->next_sibling <= i || e->next_sibling >= ih->count)) ||
+            e->name >= ih->name_count ||
+            idx->names.offsets[e->name] > idx->names.offsets[e->name + 1]) {
+            rv_freeKeyIndex(idx);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// XOR of the header's 32 bit words, not counting the checksum itself
+static uint32_t headerChecksum(const HiveHeader *hdr) {
+    return xorWords(hdr, offsetof(HiveHeader, checksum) / 4);
+}
+
+// Check a hive header's signature and checksum. Return value: NULL
+// for valid, otherwise what is wrong with it.
+static const char *headerProblem(const HiveHeader *hdr) {
+    if (strncmp(hdr->signature, "regf", 4))
+        return "Invalid header.";
+    if (headerChecksum(hdr) != hdr->checksum)
+        return "Bad checksum.";
+    return NULL;
+}
+
+// Validate a hive header by checking its checksum and signature,
+// writing what is wrong to out. Return value: 1 for valid, 0 for
+// invalid.
+int rv_validHeader(const HiveHeader *hdr, Writer *out) {
+    const char *problem = headerProblem(hdr);
+
+    if (problem) {
+        rv_writeFmt(out, "%s\n", problem);
+        return 0;
+    }
+    return 1;
+}
+
+// Transaction logs. A hive whose two update counts differ wasn't
+// cleanly written back, and the missing changes are in the .LOG1 and
+// .LOG2 files next to it. Each log is a copy of the header followed by
+// HvLE entries, each listing the 4K pages it dirtied and their
+// contents. Replaying the entries after the last good write brings the
+// hive up to date.
+//
+// The primary file stays mapped private, so writing a log page into
+// the mapping gives us a copy of just that page and leaves the rest
+// shared with the page cache. Only the old (pre-8.1) DIRT log format
+// isn't understood; such logs are ignored.
+typedef struct logEntry {
+    char signature[4];          // 'HvLE'
+    uint32_t size;              // of the whole entry, a multiple of 512
+    uint32_t flags;
+    uint32_t sequence;
+    uint32_t bins_size;         // size of the hive's hbins after this entry
+    uint32_t num_pages;
+    uint64_t data_hash;         // Marvin32 of everything after the hashes
+    uint64_t header_hash;       // Marvin32 of the 32 bytes before this
+} LogEntry;
+
+typedef struct dirtyPage {
+    uint32_t off;               // from the first hbin, like cell offsets
+    uint32_t size;
+} DirtyPage;
+
+#define LOG_TYPE_HVLE 6
+#define LOG_ENTRIES_START 0x200
+#define MARVIN32_SEED 0x82EF4D887A4E55C5ULL
+
+static inline uint32_t rotl32(uint32_t x, int n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+// The Marvin32 hash, as Windows uses to checksum log entries
+static uint64_t marvin32(const unsigned char *data, size_t len, uint64_t seed) {
+    uint32_t p0 = (uint32_t) seed, p1 = (uint32_t) (seed >> 32);
+    uint32_t word;
+
+#define MARVIN_BLOCK() do { \
+        p1 ^= p0; p0 = rotl32(p0, 20); \
+        p0 += p1; p1 = rotl32(p1, 9); \
+        p1 ^= p0; p0 = rotl32(p0, 27); \
+        p0 += p1; p1 = rotl32(p1, 19); \
+    } while (0)
+
+    for (; len >= 4; data += 4, len -= 4) {
+        memcpy(&word, data, 4);
+        p0 += word;
+        MARVIN_BLOCK();
+    }
+    // The last 0-3 bytes are padded with a single 0x80
+    word = 0x80;
+    for (size_t i = len; i-- > 0;)
+        word = (word << 8) | data[i];
+    p0 += word;
+    MARVIN_BLOCK();
+    MARVIN_BLOCK();
+#undef MARVIN_BLOCK
+    return ((uint64_t) p1 << 32) | p0;
+}
+
+typedef struct hiveLog {
+    const unsigned char *base;
+    size_t size;
+    uint32_t sequence;          // of the log's first entry
+    dev_t dev;                  // which file it is
+    ino_t ino;
+} HiveLog;
+
+// Map a transaction log. Return value: 1 if it's one we can replay,
+// 0 otherwise.
+static int openLog(HiveLog *log, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) < 0 || st.st_size < LOG_ENTRIES_START) {
+        close(fd);
+        return 0;
+    }
+    log->size = st.st_size;
+    log->dev = st.st_dev;
+    log->ino = st.st_ino;
+    log->base = mmap(NULL, log->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (log->base == MAP_FAILED) return 0;
+
+    const HiveHeader *hdr = (const HiveHeader *) log->base;
+    if (strncmp(hdr->signature, "regf", 4) || headerChecksum(hdr) != hdr->checksum ||
+        hdr->version.release != LOG_TYPE_HVLE) {
+        munmap((void *) log->base, log->size);
+        return 0;
+    }
+    log->sequence = hdr->update_count1;
+    return 1;
+}
+
+static void closeLog(HiveLog *log) {
+    munmap((void *) log->base, log->size);
+}
+
+// The log entry at *pos, if it's intact and has the given sequence
+// number, advancing *pos past it. Return value: NULL at the end of
+// the usable entries.
+static const LogEntry *nextLogEntry(const HiveLog *log, size_t *pos, uint32_t sequence) {
+    if (*pos + sizeof(LogEntry) > log->size) return NULL;
+
+    const unsigned char *p = log->base + *pos;
+    const LogEntry *e = (const LogEntry *) p;
+    if (strncmp(e->signature, "HvLE", 4) || e->sequence != sequence ||
+        e->size < sizeof(LogEntry) || e->size % 0x200 || e->size > log->size - *pos ||
+        e->num_pages > (e->size - sizeof(LogEntry)) / sizeof(DirtyPage))
+        return NULL;
+    if (marvin32(p, offsetof(LogEntry, header_hash), MARVIN32_SEED) != e->header_hash ||
+        marvin32(p + sizeof(LogEntry), e->size - sizeof(LogEntry), MARVIN32_SEED) != e->data_hash)
+        return NULL;
+
+    // The pages themselves follow the list of them
+    const DirtyPage *pages = (const DirtyPage *) (e + 1);
+    size_t data = sizeof(LogEntry) + e->num_pages * sizeof(DirtyPage);
+    for (uint32_t i = 0; i < e->num_pages; i++) {
+        if (pages[i].size > e->size - data) return NULL;
+        data += pages[i].size;
+    }
+    *pos += e->size;
+    return e;
+}
+
+static int compareLogs(const void *a, const void *b) {
+    const HiveLog *la = (const HiveLog *) a, *lb = (const HiveLog *) b;
+    return la->sequence < lb->sequence ? -1 : la->sequence > lb->sequence;
+}
+
+// Remap the hive so it's writable and at least size bytes long. The
+// file stays mapped private over the front; anything past its end is
+// anonymous memory.
+static int remapHive(Hive *hive, size_t size) {
+    struct stat st;
+
+    // A streamed hive is already anonymous memory
+    if (hive->fd < 0) {
+        if (pageRound(size) > pageRound(hive->size)) {
+            void *base = mremap((void *) hive->base, pageRound(hive->size),
+                pageRound(size), MREMAP_MAYMOVE);
+            if (base == MAP_FAILED) return 0;
+            hive->base = (const unsigned char *) base;
+        }
+        if (size > hive->size) hive->size = size;
+        return 1;
+    }
+    if (fstat(hive->fd, &st) < 0) return 0;
+    if (size < (size_t) st.st_size) size = st.st_size;
+
+    unsigned char *base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return 0;
+    if (mmap(base, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+        hive->fd, 0) == MAP_FAILED) {
+        munmap(base, size);
+        return 0;
+    }
+    munmap((void *) hive->base, hive->size);
+    hive->base = base;
+    hive->size = size;
+    return 1;
+}
+
+// Bring a dirty hive up to date from its transaction logs: those named
+// in paths, or if npaths is 0, <hive>.LOG1 and <hive>.LOG2 (unless the
+// hive came from standard input). Problems
+// are reported to out if it's non-NULL. Return value: the number of
+// log entries applied.
+int rv_replayLogs(Hive *hive, const char *path, const char *const *paths, int npaths, Writer *out) {
+    const HiveHeader *hdr = (const HiveHeader *) hive->base;
+    static const char *const suffixes[] = { ".LOG1", ".LOG2", ".log1", ".log2" };
+    HiveLog logs[4];
+    int nlogs = 0, applied = 0;
+    uint32_t first = hdr->update_count2;    // the last write that completed
+    uint32_t bins_size = 0, sequence = 0;
+
+    if (hdr->update_count1 == hdr->update_count2) return 0;
+
+    if (npaths) {
+        for (int i = 0; i < npaths && nlogs < 4; i++) {
+            if (openLog(&logs[nlogs], paths[i])) nlogs++;
+            else if (out) rv_writeFmt(out, "WARN: %s is not a usable transaction log\n", paths[i]);
+        }
+    }
+    else if (strcmp(path, "-")) {
+        size_t len = strlen(path) + sizeof(".LOG1");
+        char *name = (char *) malloc(len);
+        int upper[2] = { -1, -1 };      // where .LOG1 and .LOG2 are in logs
+        if (!name) exit(1);
+        for (int i = 0; i < 4; i++) {
+            snprintf(name, len, "%s%s", path, suffixes[i]);
+            // Case-insensitive file systems find .LOG1 again as .log1
+            struct stat st;
+            int k = i >= 2 ? upper[i - 2] : -1;
+            if (k >= 0 && !stat(name, &st) &&
+                st.st_dev == logs[k].dev && st.st_ino == logs[k].ino) {
+                continue;
+            }
+            if (openLog(&logs[nlogs], name)) {
+                if (i < 2) upper[i] = nlogs;
+                nlogs++;
+            }
+        }
+        free(name);
+    }
+
+    // Size the overlay for the biggest the hive gets, then apply the
+    // entries oldest first so later pages win
+    qsort(logs, nlogs, sizeof(HiveLog), compareLogs);
+    size_t size = hive->size;
+    for (int i = 0; i < nlogs; i++) {
+        const LogEntry *e;
+        size_t pos = LOG_ENTRIES_START;
+        for (uint32_t seq = logs[i].sequence; (e = nextLogEntry(&logs[i], &pos, seq)); seq++) {
+            if (seq - first < 0x80000000 && 0x1000 + (size_t) e->bins_size > size)
+                size = 0x1000 + (size_t) e->bins_size;
+        }
+    }
+    if (nlogs && !remapHive(hive, size)) {
+        if (out) rv_writeFmt(out, "WARN: could not map the hive for log replay\n");
+        nlogs = 0;
+    }
+
+    unsigned char *base = (unsigned char *) hive->base;
+    for (int i = 0; i < nlogs; i++) {
+        const LogEntry *e;
+        size_t pos = LOG_ENTRIES_START;
+        for (uint32_t seq = logs[i].sequence; (e = nextLogEntry(&logs[i], &pos, seq)); seq++) {
+            if (seq - first >= 0x80000000) continue;    // already in the hive
+            const DirtyPage *pages = (const DirtyPage *) (e + 1);
+            const unsigned char *data = (const unsigned char *) (pages + e->num_pages);
+            for (uint32_t p = 0; p < e->num_pages; p++) {
+                if (0x1000 + (size_t) pages[p].off + pages[p].size <= hive->size)
+                    memcpy(base + 0x1000 + pages[p].off, data, pages[p].size);
+                data += pages[p].size;
+            }
+            bins_size = e->bins_size;
+            sequence = seq;
+            applied++;
+        }
+    }
+    for (int i = 0; i < nlogs; i++) closeLog(&logs[i]);
+
+    if (!applied) {
+        if (out) rv_writeFmt(out, "WARN: hive is dirty but no transaction log entries could be applied\n");
+        return 0;
+    }
+
+    // Make the header describe the hive as it now is
+    HiveHeader *whdr = (HiveHeader *) base;
+    whdr->update_count1 = whdr->update_count2 = sequence + 1;
+    whdr->last_block = bins_size;
+    whdr->checksum = headerChecksum(whdr);
+    return applied;
+}
+
+// Find the root nk cell by looking at every cell from the start of
+// the first hbin. Only needed when the header doesn't point at it.
+// Return value: the root, or NULL if the cells run out or stop making
+// sense before it turns up.
+static const NK *scanForRoot(Hive *hive) {
+    size_t pos = 0x1000 + sizeof(BlockHeader);
+    uint32_t bin_size = hbinSize(hive, 0x1000);
+    size_t bin_end = bin_size ? 0x1000 + bin_size : hive->size;
+    const NK *root;
+    while(1) {
+        // If we're at a page boundary, see if we need to skip an hbin header
+        // This should really never happen (the root key should be within the
+        // first block), but better to be safe...
+        if((pos % 0x1000) == 0 && pos + sizeof(BlockHeader) <= hive->size &&
+            !strncmp((const char *) hive->base + pos, "hbin", 4)) {
+            bin_size = hbinSize(hive, pos);
+            bin_end = bin_size ? pos + bin_size : hive->size;
+            pos += sizeof(BlockHeader);
+        }
+        // Past an hbin that isn't followed by a good one, only the end
+        // of the file bounds the cells
+        if (pos + sizeof(int32_t) > bin_end) bin_end = hive->size;
+        if (pos + sizeof(int32_t) > hive->size) return NULL;
+
+        int32_t cell_size;
+        memcpy(&cell_size, hive->base + pos, sizeof(cell_size));
+
+        // Haven't seen this documented anywhere: it appears that the cell size
+        // is stored as a signed int and is -1 * the actual size. This is noted
+        // in WinReg.txt, but the author there seems to indicate that this is
+        // only the case for free blocks; this is clearly not the case here.
+        // Free cells, stored with a positive size, are stepped over.
+        int free_cell = cell_size > 0;
+        // Free cells can be far bigger than a page once neighbours have
+        // been merged, but no cell reaches past the end of its hbin.
+        int32_t cell_size_real = (free_cell ? cell_size : -1*cell_size) - sizeof(int);
+        if (cell_size_real < 0 || (size_t) cell_size_real > bin_end - pos - sizeof(int32_t))
+            return NULL;
+
+        // Cell offsets are relative to the first hbin and point at the size
+        root = free_cell ? NULL : getNK(hive, pos - 0x1000);
+        if(root && root->type == NK_ROOT) {
+            break;
+        }
+        pos += sizeof(int32_t) + cell_size_real;
+    }
+
+    return root;
+}
+
+// Find the root nk cell. The header's data_offset normally points
+// straight at it; a damaged one falls back to scanning for it. Return
+// value: the root, or NULL if there isn't one to be found.
+const NK *rv_findRoot(Hive *hive) {
+    const HiveHeader *hdr = (const HiveHeader *) hive->base;
+    const NK *root = getNK(hive, hdr->data_offset);
+
+    if (root && root->type == NK_ROOT)
+        return root;
+    return scanForRoot(hive);
+}
+
+// Diffing two snapshots of a hive. Subkeys are matched by name, with
+// each side's list sorted the way Windows sorts it, so one merge pass
+// per level pairs them up. Every key is compared unless prune is set.
+// Then a key whose LastWrite time, subkey count and subkey list cell
+// are the same on both sides is taken to have the same subtree and is
+// not descended into. That is only a guess: Windows bumps LastWrite
+// for changes to the key itself, not for changes further down, so a
+// pruned diff can miss them.
+typedef struct diffChild {
+    const NK *key;
+    size_t len;                 // of the name as stored
+    int form;
+} DiffChild;
+
+static int compareDiffChildren(const void *a, const void *b) {
+    const DiffChild *ca = (const DiffChild *) a, *cb = (const DiffChild *) b;
+    return compareNameForms(ca->key->name, ca->len, ca->form, cb->key->name, cb->len, cb->form);
+}
+
+// The subkeys of key, sorted by name, for them to be compared at
+// level. Return value: the number of subkeys; *children must be freed
+// by the caller.
+static int diffChildren(Hive *hive, const NK *key, int level, DiffChild **children) {
+    WalkFrame f;
+    uint32_t off;
+    int n = 0, cap = 0;
+
+    *children = NULL;
+    if (!hasSubkeys(key)) return 0;
+    if (!openFrame(hive, key, &f, NULL)) return 0;
+    while (nextSubkey(hive, &f, &off) > 0) {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            *children = (DiffChild *) realloc(*children, cap * sizeof(DiffChild));
+            if (!*children) exit(1);
+        }
+        const NK *child = needSubkey(hive, &f, 1, off, level);
+        if (!child) break;
+        (*children)[n].key = child;
+        (*children)[n].len = keyNameLen(child);
+        (*children)[n].form = keyNameForm(child);
+        n++;
+    }
+    qsort(*children, n, sizeof(DiffChild), compareDiffChildren);
+    return n;
+}
+
+// One level of the lockstep walk: the sorted subkeys of a key on each
+// side, and how far the merge has got through them
+typedef struct diffFrame {
+    DiffChild *a;
+    DiffChild *b;
+    int na, nb;
+    int ia, ib;
+    size_t path_len;
+} DiffFrame;
+
+typedef struct differ {
+    Hive *a;
+    Hive *b;
+    int prune;
+    Writer *out;
+    char *path;
+    size_t path_len;
+    size_t path_cap;
+    Arena arena;
+} Differ;
+
+// Make the path that of key, below the first len bytes of the path
+static void diffSetPath(Differ *d, size_t len, const NK *key) {
+    size_t need = len + 1 + UTF8_NAME_MAX(key->name_len);
+    if (need > d->path_cap) {
+        while (need > d->path_cap) d->path_cap = d->path_cap ? d->path_cap * 2 : 1024;
+        d->path = (char *) realloc(d->path, d->path_cap);
+        if (!d->path) exit(1);
+    }
+    d->path_len = len;
+    if (len) d->path[d->path_len++] = '\\';
+    d->path_len += nameToUtf8(key->name, key->name_len, key->type & NK_COMP_NAME,
+        d->path + d->path_len);
+}
+
+// Print a line about the key at the current path, or one of its values
+static void diffLine(Differ *d, char what, const VK *value) {
+    writeChar(d->out, what);
+    writeChar(d->out, ' ');
+    rv_writeBytes(d->out, d->path, d->path_len);
+    if (value) {
+        rv_writeStr(d->out, " : ");
+        if (value->name_len) writeName(d->out, value->name, value->name_len, value->flags & VK_COMP_NAME);
+        else rv_writeStr(d->out, "(default)");
+    }
+    writeChar(d->out, '\n');
+}
+
+typedef struct diffValue {
+    const VK *vk;
+    size_t len;                 // of the name as stored
+    int form;
+} DiffValue;
+
+static int compareDiffValues(const void *a, const void *b) {
+    const DiffValue *va = (const DiffValue *) a, *vb = (const DiffValue *) b;
+    return compareNameForms(va->vk->name, va->len, va->form, vb->vk->name, vb->len, vb->form);
+}
+
+// The values of key, sorted by name, allocated from arena
+static int diffValues(Hive *hive, const NK *key, Arena *arena, DiffValue **values) {
+    const uint32_t *list = getValueList(hive, key);
+    int n = 0;
+
+    *values = NULL;
+    if (!list) return 0;
+    *values = (DiffValue *) arenaAlloc(arena, key->num_values * sizeof(DiffValue));
+    for (int i = 0; i < key->num_values; i++) {
+        const VK *vk = getVK(hive, list[i]);
+        if (!vk) continue;
+        (*values)[n].vk = vk;
+        (*values)[n].len = valueNameLen(vk);
+        (*values)[n].form = valueNameForm(vk);
+        n++;
+    }
+    qsort(*values, n, sizeof(DiffValue), compareDiffValues);
+    return n;
+}
+
+// Report values added, removed or changed between two versions of a key
+static void diffKeyValues(Differ *d, const NK *a, const NK *b) {
+    ArenaMark mark = arenaMark(&d->arena);
+    DiffValue *va, *vb;
+    int na = diffValues(d->a, a, &d->arena, &va);
+    int nb = diffValues(d->b, b, &d->arena, &vb);
+    int i = 0, j = 0;
+
+    while (i < na || j < nb) {
+        int c = i == na ? 1 : j == nb ? -1 :
+            compareDiffValues(&va[i], &vb[j]);
+        if (c < 0) {
+            diffLine(d, '-', va[i].vk);
+            i++;
+        }
+        else if (c > 0) {
+            diffLine(d, '+', vb[j].vk);
+            j++;
+        }
+        else {
+            ValueData da, db;
+            int oka = getValueData(d->a, va[i].vk, &d->arena, &da);
+            int okb = getValueData(d->b, vb[j].vk, &d->arena, &db);
+            if (va[i].vk->type != vb[j].vk->type || oka != okb ||
+                (oka && (da.len != db.len || (da.len && memcmp(da.ptr, db.ptr, da.len))))) {
+                diffLine(d, 'M', va[i].vk);
+            }
+            i++;
+            j++;
+        }
+    }
+    arenaRelease(&d->arena, mark);
+}
+
+// Compare one key that exists on both sides. Return value: 1 if its
+// subkeys need comparing too.
+static int diffKey(Differ *d, const NK *a, const NK *b) {
+    int same_time = !memcmp(&a->modified, &b->modified, sizeof(FILETIME));
+
+    if (!same_time)
+        diffLine(d, 'M', NULL);
+    if (!d->prune || !same_time || a->values != b->values || a->num_values != b->num_values)
+        diffKeyValues(d, a, b);
+    return !(d->prune && same_time && a->num_subkeys == b->num_subkeys &&
+        a->subkeys == b->subkeys);
+}
+
+// Print the differences between two hives' trees, from the roots down
+// in walk order: "+ path" for an added key, "- path" for a removed one
+// (their subkeys aren't listed), "M path" for a changed LastWrite time
+// and "+/-/M path : value" for values.
+void rv_diffTrees(Hive *ha, const NK *ra, Hive *hb, const NK *rb, int prune, Writer *out) {
+    Differ d = { .a = ha, .b = hb, .prune = prune, .out = out, .path = NULL,
+        .path_len = 0, .path_cap = 0, .arena = { NULL, NULL } };
+    DiffFrame *stack = NULL;
+    int depth = 0, cap = 0;
+
+    diffSetPath(&d, 0, ra);
+    if (diffKey(&d, ra, rb)) {
+        cap = 16;
+        stack = (DiffFrame *) malloc(cap * sizeof(DiffFrame));
+        if (!stack) exit(1);
+        stack[0].na = diffChildren(ha, ra, 1, &stack[0].a);
+        stack[0].nb = diffChildren(hb, rb, 1, &stack[0].b);
+        stack[0].ia = stack[0].ib = 0;
+        stack[0].path_len = d.path_len;
+        depth = 1;
+    }
+
+    while (depth > 0) {
+        DiffFrame *f = &stack[depth - 1];
+        if (f->ia == f->na && f->ib == f->nb) {
+            free(f->a);
+            free(f->b);
+            depth--;
+            continue;
+        }
+
+        int c = f->ia == f->na ? 1 : f->ib == f->nb ? -1 :
+            compareDiffChildren(&f->a[f->ia], &f->b[f->ib]);
+        if (c < 0) {
+            diffSetPath(&d, f->path_len, f->a[f->ia].key);
+            diffLine(&d, '-', NULL);
+            f->ia++;
+            continue;
+        }
+        if (c > 0) {
+            diffSetPath(&d, f->path_len, f->b[f->ib].key);
+            diffLine(&d, '+', NULL);
+            f->ib++;
+            continue;
+        }
+
+        const NK *ka = f->a[f->ia++].key;
+        const NK *kb = f->b[f->ib++].key;
+        diffSetPath(&d, f->path_len, ka);
+        if (!diffKey(&d, ka, kb)) continue;
+
+        if (depth == cap) {
+            cap *= 2;
+            stack = (DiffFrame *) realloc(stack, cap * sizeof(DiffFrame));
+            if (!stack) exit(1);
+        }
+        f = &stack[depth++];
+        f->na = diffChildren(ha, ka, depth, &f->a);
+        f->nb = diffChildren(hb, kb, depth, &f->b);
+        f->ia = f->ib = 0;
+        f->path_len = d.path_len;
+    }
+
+    free(stack);
+    free(d.path);
+    freeArena(&d.arena);
+}
+
+// Several hives mounted into one namespace, as on a running system.
+// The mount paths make a small tree of their own above the hives'
+// keys, with any node of it that no hive is mounted on existing only
+// as a step on the way to the mounts, like HKLM. Keys are shown and
+// looked up through that tree, and the hives are printed or indexed
+// together: one pool of threads and one set of sk caches for the lot
+// when printing, one name table when indexing.
+void rv_initMountTable(MountTable *mt) {
+    mt->mounts = NULL;
+    mt->count = 0;
+    mt->nodes = (MountNode *) malloc(sizeof(MountNode));
+    if (!mt->nodes) exit(1);
+    mt->nodes[0].name = "";
+    mt->nodes[0].len = 0;
+    mt->nodes[0].first_child = -1;
+    mt->nodes[0].next_sibling = -1;
+    mt->nodes[0].mount = -1;
+    mt->nnodes = 1;
+}
+
+void rv_freeMountTable(MountTable *mt) {
+    for (int i = 0; i < mt->count; i++) {
+        rv_closeHive(&mt->mounts[i].hive);
+        free(mt->mounts[i].vpath);
+    }
+    free(mt->mounts);
+    free(mt->nodes);
+    memset(mt, 0, sizeof(*mt));
+}
+
+// Return the child of node called name, or -1 if there isn't one
+static int findMountChild(const MountTable *mt, int node, const char *name, size_t len) {
+    int i;
+    for (i = mt->nodes[node].first_child; i >= 0; i = mt->nodes[i].next_sibling) {
+        if (!compareNames(mt->nodes[i].name, mt->nodes[i].len, name, len)) break;
+    }
+    return i;
+}
+
+// Add a child called name to node, in key order among the others.
+// Return value: the new node.
+static int addMountChild(MountTable *mt, int node, const char *name, size_t len, int mount) {
+    mt->nodes = (MountNode *) realloc(mt->nodes, (mt->nnodes + 1) * sizeof(MountNode));
+    if (!mt->nodes) exit(1);
+    int n = mt->nnodes++;
+    mt->nodes[n].name = name;
+    mt->nodes[n].len = len;
+    mt->nodes[n].first_child = -1;
+    mt->nodes[n].mount = mount;
+
+    int *link = &mt->nodes[node].first_child;
+    while (*link >= 0 &&
+        compareNames(mt->nodes[*link].name, mt->nodes[*link].len, name, len) < 0)
+        link = &mt->nodes[*link].next_sibling;
+    mt->nodes[n].next_sibling = *link;
+    *link = n;
+    return n;
+}
+
+// Mount a hive as spec says, "vpath=file". A mount can't go inside
+// another, nor above one. Return value: 1 on success, 0 after
+// printing why not.
+int rv_addMount(MountTable *mt, const char *spec, Writer *out) {
+    const char *eq = strchr(spec, '=');
+    if (!eq || !eq[1]) {
+        rv_writeFmt(out, "Bad mount %s: expected vpath=file\n", spec);
+        return 0;
+    }
+    char *vpath = strndup(spec, eq - spec);
+    const char *path = eq + 1;
+    if (!vpath) exit(1);
+
+    // Find where the new path parts from those already mounted
+    const char *rest = vpath, *name;
+    size_t len;
+    int node = 0, more;
+    while ((more = nextComponent(&rest, &name, &len))) {
+        int c = findMountChild(mt, node, name, len);
+        if (c < 0) break;
+        node = c;
+        if (mt->nodes[c].mount >= 0) break;
+    }
+    if (!more && !node) {
+        rv_writeFmt(out, "Bad mount %s: expected vpath=file\n", spec);
+        free(vpath);
+        return 0;
+    }
+    if (!more || mt->nodes[node].mount >= 0) {
+        rv_writeFmt(out, "%s: can't mount at %s: overlaps another mount\n", path, vpath);
+        free(vpath);
+        return 0;
+    }
+
+    Mount m;
+    m.vpath = vpath;
+    m.path = path;
+    if (!rv_openHive(&m.hive, path, 0, out)) {
+        free(vpath);
+        return 0;
+    }
+    if (!rv_validHeader((const HiveHeader *) m.hive.base, out)) {
+        rv_writeFmt(out, "%s: registry file failed basic validation.\n", path);
+        rv_closeHive(&m.hive);
+        free(vpath);
+        return 0;
+    }
+    rv_replayLogs(&m.hive, path, NULL, 0, out);
+    if (!(m.root = rv_findRoot(&m.hive))) {
+        rv_writeFmt(out, "%s: root key not found.\n", path);
+        rv_closeHive(&m.hive);
+        free(vpath);
+        return 0;
+    }
+
+    mt->mounts = (Mount *) realloc(mt->mounts, (mt->count + 1) * sizeof(Mount));
+    if (!mt->mounts) exit(1);
+    mt->mounts[mt->count] = m;
+    while (1) {
+        const char *next;
+        size_t next_len;
+        int last = !nextComponent(&rest, &next, &next_len);
+        node = addMountChild(mt, node, name, len, last ? mt->count : -1);
+        if (last) break;
+        name = next;
+        len = next_len;
+    }
+    mt->count++;
+    return 1;
+}
+
+// Where a path in a MountTable leads: a key of one of the hives, or a
+// node above them all, with key NULL
+typedef struct mountPos {
+    int node;               // the node, or the mount point the key is under
+    Hive *hive;
+    const NK *key;
+} MountPos;
+
+#define MAX_LINK_HOPS 16
+
+static int resolveMountPath(const MountTable *mt, const char *path, int *hops, MountPos *pos);
+
+// Where link targets point, as the kernel writes them, and the names
+// they're mounted under here
+static const char *const link_roots[][2] = {
+    { "\\REGISTRY\\MACHINE", "HKLM" },
+    { "\\REGISTRY\\USER", "HKU" },
+};
+
+// Follow a symbolic link key to wherever its SymbolicLinkValue points.
+// Return value: 1 if the target is mounted and was found, else 0.
+static int followLink(const MountTable *mt, Hive *hive, const NK *key, int *hops, MountPos *pos) {
+    static const char link_value[] = "SymbolicLinkValue";
+    const uint32_t *values = getValueList(hive, key);
+    Arena arena;
+    ValueData data;
+    int found = 0, ok = 0;
+
+    if (++*hops > MAX_LINK_HOPS) return 0;
+    initArena(&arena);
+    for (int i = 0; values && i < key->num_values && !found; i++) {
+        const VK *vk = getVK(hive, values[i]);
+        found = vk && vk->type == REG_LINK &&
+            !compareNameForms(vk->name, valueNameLen(vk), valueNameForm(vk),
+                link_value, sizeof(link_value) - 1, NAME_UTF8) &&
+            getValueData(hive, vk, &arena, &data);
+    }
+    if (found) {
+        // The target is UTF-16, maybe with a terminator
+        size_t units = data.len / 2;
+        for (size_t i = 0; i < units; i++) {
+            if (!data.ptr[2 * i] && !data.ptr[2 * i + 1]) units = i;
+        }
+        char *target = (char *) arenaAlloc(&arena, UTF8_NAME_MAX(2 * units) + 1);
+        size_t len = utf16ToUtf8(data.ptr, units, target);
+        target[len] = '\0';
+
+        for (size_t i = 0; i < sizeof(link_roots) / sizeof(link_roots[0]); i++) {
+            const char *from = link_roots[i][0], *to = link_roots[i][1];
+            size_t from_len = strlen(from), to_len = strlen(to);
+            if (len < from_len || compareNames(target, from_len, from, from_len) ||
+                (target[from_len] && target[from_len] != '\\'))
+                continue;
+            char *vpath = (char *) arenaAlloc(&arena, to_len + len - from_len + 1);
+            memcpy(vpath, to, to_len);
+            memcpy(vpath + to_len, target + from_len, len - from_len + 1);
+            ok = resolveMountPath(mt, vpath, hops, pos);
+            break;
+        }
+    }
+    freeArena(&arena);
+    return ok;
+}
+
+// Find what path leads to. Symbolic links are followed as they are
+// met, up to MAX_LINK_HOPS of them, counting in *hops. Return value:
+// 1 if there is something there, else 0.
+static int resolveMountPath(const MountTable *mt, const char *path, int *hops, MountPos *pos) {
+    MountPos p = { 0, NULL, NULL };
+    const char *name;
+    size_t len;
+
+    while (nextComponent(&path, &name, &len)) {
+        if (!p.key) {
+            int node = findMountChild(mt, p.node, name, len);
+            if (node < 0) return 0;
+            p.node = node;
+            if (mt->nodes[node].mount >= 0) {
+                Mount *m = &mt->mounts[mt->nodes[node].mount];
+                p.hive = &m->hive;
+                p.key = m->root;
+            }
+            continue;
+        }
+        const NK *key = findSubkey(p.hive, p.key, name, len);
+        if (!key) return 0;
+        if (key->type & NK_LINK) {
+            if (!followLink(mt, p.hive, key, hops, &p)) return 0;
+        }
+        else {
+            p.key = key;
+        }
+    }
+    *pos = p;
+    return 1;
+}
+
+// Add the lines for node and everything below it to pw, from level.
+// The tree of mount paths is only as deep as the longest of them.
+static void addMountSegments(MountTable *mt, ParallelWalk *pw, int node, int level) {
+    const MountNode *n = &mt->nodes[node];
+    if (n->mount >= 0) {
+        Mount *m = &mt->mounts[n->mount];
+        addWholeSegment(pw, &m->hive, m->root, level);
+        expandSegment(pw, pw->nsegs - 1, n->name, n->len);
+        return;
+    }
+    if (node) addLineSegment(pw, n->name, n->len, level);
+    for (int c = n->first_child; c >= 0; c = mt->nodes[c].next_sibling) {
+        addMountSegments(mt, pw, c, node ? level + 1 : level);
+    }
+}
+
+// Print the key at path in a MountTable and everything below it, as
+// rv_printSubTree does, using nthreads threads. The top of the namespace
+// has no line of its own, and a hive's root is shown under the name
+// it's mounted as. Return value: 1 on success, 0 if there is nothing
+// at path.
+int rv_printMountTree(MountTable *mt, const char *path, int nthreads,
+        const PrintOptions *opts, Writer *out) {
+    ParallelWalk pw;
+    MountPos pos;
+    int hops = 0;
+
+    if (!resolveMountPath(mt, path ? path : "", &hops, &pos)) return 0;
+    initParallelWalk(&pw, opts);
+    if (!pos.key) {
+        addMountSegments(mt, &pw, pos.node, 0);
+    }
+    else {
+        const MountNode *n = &mt->nodes[pos.node];
+        addWholeSegment(&pw, pos.hive, pos.key, 0);
+        if (pos.key == mt->mounts[n->mount].root) expandSegment(&pw, 0, n->name, n->len);
+    }
+    runSegments(&pw, nthreads, out);
+    return 1;
+}
+
+static void indexMountNode(MountTable *mt, IndexBuilder *b, Walker *w, int node, int level) {
+    const MountNode *n = &mt->nodes[node];
+    if (n->mount >= 0) {
+        Mount *m = &mt->mounts[n->mount];
+        uint32_t root = b->idx->count;
+        walkSubTree(w, &m->hive, m->root, level, indexKeyVisitor, b);
+        b->idx->keys[root].name = internName(&b->idx->names, n->name, n->len);
+        return;
+    }
+    FILETIME never = { 0, 0 };
+    addIndexKey(b, n->name, n->len, never, level);
+    for (int c = n->first_child; c >= 0; c = mt->nodes[c].next_sibling) {
+        indexMountNode(mt, b, w, c, level + 1);
+    }
+}
+
+// Build one KeyIndex of every hive in a MountTable. Key 0 is the top
+// of the namespace, with an empty name, and rv_lookupIndexKey takes the
+// same paths as rv_printMountTree, except that links aren't followed.
+void rv_buildMountIndex(MountTable *mt, KeyIndex *idx) {
+    IndexBuilder b;
+    Walker w;
+
+    initIndexBuilder(&b, idx);
+    initWalker(&w, &rv_output);
+    indexMountNode(mt, &b, &w, 0, 0);
+    freeWalker(&w);
+    freeIndexBuilder(&b);
+}
+
+
+// The library interface (see regview.h). Unlike the rest of this
+// file, nothing below gives up on a damaged hive: a bad cell makes a
+// call fail rather than the process exit.
+struct rvHive {
+    Hive hive;
+    const NK *root;
+};
+
+// A cursor is the path from the root to its key. Every level but the
+// root also keeps its place in its parent's subkey list, so moving to
+// the next sibling carries on from there instead of starting over.
+typedef struct cursorLevel {
+    const NK *key;
+    WalkFrame siblings;         // unused for the root
+} CursorLevel;
+
+struct rvCursor {
+    RvHive *hive;
+    CursorLevel *levels;
+    int depth;
+    int cap;
+    Arena arena;                // what rvCursorValue had to put together
+    Arena name;                 // the last name rvCursorName decoded
+    ArenaMark empty;            // of arena
+    ArenaMark empty_name;       // of name
+};
+
+int rvOpenHive(const char *path, RvHive **hive) {
+    RvHive *h = (RvHive *) malloc(sizeof(RvHive));
+    const char *why;
+
+    if (!h) return 0;
+    if (!mapHive(&h->hive, path, 0, &why)) {
+        free(h);
+        return 0;
+    }
+    if (headerProblem((const HiveHeader *) h->hive.base)) {
+        rvCloseHive(h);
+        return 0;
+    }
+    rv_replayLogs(&h->hive, path, NULL, 0, NULL);
+    if (!(h->root = rv_findRoot(&h->hive))) {
+        rvCloseHive(h);
+        return 0;
+    }
+    *hive = h;
+    return 1;
+}
+
+void rvCloseHive(RvHive *hive) {
+    rv_closeHive(&hive->hive);
+    free(hive);
+}
+
+int rvCursorOpen(RvHive *hive, RvCursor **cursor) {
+    RvCursor *c = (RvCursor *) malloc(sizeof(RvCursor));
+
+    if (!c) return 0;
+    c->cap = 16;
+    c->levels = (CursorLevel *) malloc(c->cap * sizeof(CursorLevel));
+    if (!c->levels) {
+        free(c);
+        return 0;
+    }
+    c->hive = hive;
+    c->depth = 0;
+    c->levels[0].key = hive->root;
+    initArena(&c->arena);
+    initArena(&c->name);
+    c->empty = arenaMark(&c->arena);
+    c->empty_name = arenaMark(&c->name);
+    *cursor = c;
+    return 1;
+}
+
+void rvCursorClose(RvCursor *c) {
+    freeArena(&c->arena);
+    freeArena(&c->name);
+    free(c->levels);
+    free(c);
+}
+
+// Move a frame on to the next subkey that is a readable nk cell.
+// Return value: the key, or NULL at the end of the list or a bad one.
+static const NK *nextCursorKey(Hive *hive, WalkFrame *f) {
+    uint32_t off;
+
+    if (stepFrame(hive, f, &off) != 1) return NULL;
+    return getNK(hive, off);
+}
+
+int rvCursorFirstChild(RvCursor *c) {
+    Hive *hive = &c->hive->hive;
+    const NK *key = c->levels[c->depth].key;
+    WalkFrame f;
+
+    if (!hasSubkeys(key) || readSubkeyList(hive, key->subkeys, &f.list) != 1)
+        return 0;
+    resetFrame(&f);
+    if (!(key = nextCursorKey(hive, &f))) return 0;
+
+    if (c->depth + 1 == c->cap) {
+        CursorLevel *levels = (CursorLevel *) realloc(c->levels,
+            2 * c->cap * sizeof(CursorLevel));
+        if (!levels) return 0;
+        c->levels = levels;
+        c->cap *= 2;
+    }
+    CursorLevel *l = &c->levels[++c->depth];
+    l->key = key;
+    l->siblings = f;
+    return 1;
+}
+
+int rvCursorNextSibling(RvCursor *c) {
+    if (!c->depth) return 0;
+
+    CursorLevel *l = &c->levels[c->depth];
+    WalkFrame f = l->siblings;
+    const NK *key = nextCursorKey(&c->hive->hive, &f);
+    if (!key) return 0;
+    l->key = key;
+    l->siblings = f;
+    return 1;
+}
+
+int rvCursorParent(RvCursor *c) {
+    if (!c->depth) return 0;
+    c->depth--;
+    return 1;
+}
+
+int rvCursorDepth(const RvCursor *c) {
+    return c->depth;
+}
+
+const char *rvCursorName(RvCursor *c, size_t *len) {
+    arenaRelease(&c->name, c->empty_name);
+    return keyName(&c->name, c->levels[c->depth].key, len);
+}
+
+uint64_t rvCursorModified(const RvCursor *c) {
+    const FILETIME *ft = &c->levels[c->depth].key->modified;
+    return ((uint64_t) ft->dwHighDateTime << 32) | ft->dwLowDateTime;
+}
+
+uint32_t rvCursorNumSubkeys(const RvCursor *c) {
+    const NK *key = c->levels[c->depth].key;
+    return hasSubkeys(key) && key->num_subkeys > 0 ? key->num_subkeys : 0;
+}
+
+uint32_t rvCursorNumValues(const RvCursor *c) {
+    const NK *key = c->levels[c->depth].key;
+    return key->num_values > 0 && key->values != 0xFFFFFFFF ? key->num_values : 0;
+}
+
+int rvCursorValue(RvCursor *c, uint32_t i, RvValue *value) {
+    Hive *hive = &c->hive->hive;
+    const NK *key = c->levels[c->depth].key;
+    const uint32_t *list = getValueList(hive, key);
+    const VK *vk;
+    ValueData data;
+
+    if (!list || i >= (uint32_t) key->num_values || !(vk = getVK(hive, list[i])))
+        return 0;
+    arenaRelease(&c->arena, c->empty);
+    if (!getValueData(hive, vk, &c->arena, &data)) return 0;
+
+    value->name = valueName(&c->arena, vk, &value->name_len);
+    value->type = vk->type;
+    value->data = data.ptr;
+    value->len = data.len;
+    return 1;
+}
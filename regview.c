@@ -1,413 +1,564 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <stdint.h>
-#include <time.h>
-
-typedef struct _FILETIME {
-    uint32_t dwLowDateTime;
-    uint32_t dwHighDateTime;
-} FILETIME;
-
-#define NK_ROOT 0x2c
-#define NK_NODE 0x20
-#define NK_LINK 0x10
-
-// Offsets in registry hives are relative to the first hbin block,
-// and point to the cell size (which we usually don't want).
-// Convert them to the true file offset of the structure.
-uint32_t convOff(unsigned int off) {
-    return off + 0x1000 + 4;
-}
-
-typedef struct hiveVersion {
-    uint32_t major;
-    uint32_t minor;
-    uint32_t release;
-    uint32_t build;
-} HiveVersion;
-
-// Represents a node/key. Links to other node/keys (ie subkeys), and
-// also to values and security descriptors.
-typedef struct nk_cell {
-    char signature[2];  // 'nk'
-    short type;         // 0x2c for root, 0x20 for non-root, 0x10 for symlinks
-    FILETIME modified;
-    uint32_t u1;
-    uint32_t parent;
-    int32_t num_subkeys;
-    uint32_t u2;
-    uint32_t subkeys;
-    uint32_t u3;
-    int32_t num_values;
-    uint32_t values;
-    uint32_t security;
-    uint32_t classname;
-    uint32_t u4[5];
-    unsigned short name_len;
-    unsigned short classname_len;
-    char name[1];
-} NK;
-
-// Note: lh and lf records only differ in the type of hash used,
-// which we are ignoring.
-typedef struct lh_cell {
-    char signature[2];
-    short num_entries;
-} LH;
-
-typedef struct ri_cell {
-    char signature[2];
-    short num_entries;
-    uint32_t entries[1];
-} RI;
-
-typedef struct hashrec {
-    uint32_t offset;
-    char hash[4];       // First 4 chars of keyname for lf, base37 
-} HashRec;
-
-typedef struct hiveHeader {
-    char signature[4];              // 'regf'
-    uint32_t update_count1;
-    uint32_t update_count2;
-    FILETIME modified;
-    HiveVersion version;
-    uint32_t data_offset;
-    uint32_t last_block;
-    uint32_t unknown;           // Always 1
-    unsigned char padding[0x1cc];
-    uint32_t checksum;          // XOR of 0x00 through 0x1FC
-} HiveHeader;
-
-typedef struct blockHeader {
-    char signature[4];          // 'hbin'
-    uint32_t off;           // offset from the first hbin block
-    uint32_t next;          // offset to the next hbin block
-    uint32_t padding[2];    // unknown
-    FILETIME modified;          // last modified time
-    uint32_t block_size;
-} BlockHeader;
-
-#define WINDOWS_TICK 10000000
-#define SEC_TO_UNIX_EPOCH 11644473600LL
-
-unsigned WindowsTickToUnixSeconds(uint64_t windowsTicks)
-{
-     return (unsigned)(windowsTicks / WINDOWS_TICK - SEC_TO_UNIX_EPOCH);
-}
-
-// Print an NT time in human-readable format
-void printNTTime(FILETIME *ft) {
-    uint64_t ticks = ((uint64_t)ft->dwHighDateTime << 32) | ft->dwLowDateTime;
-    time_t unix_time = WindowsTickToUnixSeconds(ticks);
-
-    //printf("Last modification time: %02d/%02d/%04d %02d:%02d:%02d +%d ms UTC\n",
-    //  s.wMonth, s.wDay, s.wYear, s.wHour, s.wMinute, s.wSecond, s.wMilliseconds);
-    printf("Last modification time: %s", ctime(&unix_time));
-     
-    return;
-}
-
-// Print information about an nk record
-void printNK(NK *nodeKey) {
-    char *nkName = (char *) malloc(nodeKey->name_len + 1);
-    if (!nkName) exit(1);
-    strncpy(nkName, nodeKey->name, nodeKey->name_len);
-    nkName[nodeKey->name_len] = '\0';
-    printf("%.2s: type 0x%x parent 0x%x, %d subkeys at 0x%x, %d values at 0x%x, "
-        "security descriptor at 0x%0x, name %s\n", nodeKey->signature,
-        nodeKey->type, nodeKey->parent, nodeKey->num_subkeys, nodeKey->subkeys,
-        nodeKey->num_values, nodeKey->values, nodeKey->security,
-        nkName);
-    free(nkName);
-    return;
-}
-
-// Print only the name for a node/key
-void printNKName(NK *nodeKey, int tabs) {
-    for(int i = 0; i < tabs; i++) {
-        printf(" ");
+#include <unistd.h>
+#include <pthread.h>
+#include <getopt.h>
+
+#include "internal.h"
+
+// Everything the command line can ask for, other than which hives
+typedef struct options {
+    int nthreads;
+    PrintOptions print;
+    KeyFilter filter;           // walked serially when active
+    int json;
+    int sweep;
+    int carve;
+    int verify;
+    int timeline;               // TIMELINE_ format, or 0
+    size_t sort_mem;            // bytes a timeline may sort in memory
+    int use_index;
+    int index_stats;
+    int use_cache;
+    const char *cache_path;     // NULL for next to the hive
+    const char *key_path;
+    int diff_prune;             // --prune: skip subtrees that look unchanged
+    const char *logs[2];        // --log, instead of looking next to the hive
+    int nlogs;
+    const char **mounts;        // --mount, as "vpath=file"
+    int nmounts;
+} Options;
+
+// Do what opts asks for with the hive at path, printing to out.
+// Return value: 1 on success, 0 if the hive couldn't be opened or the
+// key asked for isn't there.
+int processHive(const char *path, const Options *opts, Writer *out) {
+    Hive hive;
+    const HiveHeader *hdr;
+    const char *cache_path = opts->cache_path;
+    char *default_cache = NULL;
+    int ok = 1;
+
+    // Carving looks for deleted records all through the free space,
+    // which a hive read from a pipe would otherwise not keep
+    if (!rv_openHive(&hive, path, opts->carve || opts->sweep ? HIVE_KEEP_FREE : 0, out)) {
+        return 0;
     }
-    char *nkName = (char *) malloc(nodeKey->name_len + 1);
-    if (!nkName) exit(1);
-    strncpy(nkName, nodeKey->name, nodeKey->name_len);
-    nkName[nodeKey->name_len] = '\0';
-    printf("%s\n", nkName);
-    free(nkName);
-
-    return;
-}
 
-// Print a node and its subtree
-void printSubTree(NK *root, FILE *regf, int level) {
-    printNKName(root, level);
-    if(root->num_subkeys == 0 || root->subkeys == 0 ||
-        root->subkeys == 0xFFFFFFFF) {
-        //printf("End of subtree, returning\n");
-        return;
+    // Check the global header
+    hdr = (const HiveHeader *) hive.base;
+    if(!rv_validHeader(hdr, out)) {
+        rv_writeFmt(out, "Registry file failed basic validation.\n");
+        rv_closeHive(&hive);
+        return 0;
+    }
+    // Machine-readable output has nothing else mixed in
+    int quiet = opts->json || opts->timeline;
+    if (rv_replayLogs(&hive, path, opts->logs, opts->nlogs, quiet ? NULL : out))
+        hdr = (const HiveHeader *) hive.base;
+    if (!quiet)
+        rv_printNTTime(&hdr->modified, out);
+
+    // By default the index cache sits next to the hive, so a hive from
+    // standard input has none
+    if (opts->use_cache && !cache_path && strcmp(path, "-")) {
+        size_t len = strlen(path) + sizeof(".rvidx");
+        default_cache = (char *) malloc(len);
+        if (!default_cache) exit(1);
+        snprintf(default_cache, len, "%s.rvidx", path);
+        cache_path = default_cache;
     }
-    //printf("%d %x\n", root->num_subkeys, root->subkeys);
-
-    LH lh;
-    fseek(regf,convOff(root->subkeys),SEEK_SET);
-    //printf("Reading entry at %x\n", convOff(root->subkeys));
-    fread(&lh, sizeof(LH), 1, regf);
-
-    if(!strncmp(lh.signature, "lh", 2) || !strncmp(lh.signature, "lf", 2)) {
-        //printf("%d entries in this hashlist\n", lh.num_entries);
-        if(lh.num_entries < 0) exit(1);
-        if(root->num_subkeys != lh.num_entries) {
-            printf("WARN: number of subkeys does not match, %d != %d\n",
-                root->num_subkeys, lh.num_entries);
-        }
 
-        HashRec *hashes;
-        hashes = (HashRec *) malloc(lh.num_entries * sizeof(HashRec));
-        if (!hashes) exit(1);
-
-        int nread = fread(hashes, sizeof(HashRec), lh.num_entries, regf);
-        if (nread < lh.num_entries) {
-            if(feof(regf))
-                printf("Unexpected EOF while reading file.\n");
-            if(ferror(regf)) {
-                printf("fread failed, file error.\n");
-                perror( "Read error (line 156)" );
+    if (opts->verify) {
+        ok = rv_printVerify(&hive, opts->nthreads, out);
+    }
+    else if (opts->sweep) {
+        rv_printSweep(&hive, out);
+    }
+    else if (opts->carve) {
+        rv_printCarve(&hive, opts->nthreads, out);
+    }
+    else if (opts->use_index || opts->index_stats || opts->use_cache) {
+        KeyIndex idx;
+        if (!cache_path || !rv_loadKeyIndex(&idx, hdr, cache_path)) {
+            const NK *root = rv_findRoot(&hive);
+            if (!root) {
+                rv_writeFmt(out, "Root key not found.\n");
+                free(default_cache);
+                rv_closeHive(&hive);
+                return 0;
             }
-            exit(1);
+            rv_buildKeyIndex(&hive, root, &idx);
+            // An index cut short by a bad cell isn't worth keeping
+            if (cache_path && !rv_hive_errors && !rv_saveKeyIndex(&idx, hdr, cache_path))
+                rv_writeFmt(out, "WARN: could not write index cache %s\n", cache_path);
         }
-
-        //for(int i = 0; i < lh.num_entries; i++) {
-        //  printf("%x\n", hashes[i].offset);
-        //}
-
-        // Read the nk entry that each lh hash entry points to
-        // Note that since the length of the nk name is not known
-        // ahead of time we have to read the structure twice
-        for(int i = 0; i < lh.num_entries; i++) {
-            NK *next;
-            next = (NK *)malloc(sizeof(NK));
-            if (!next) exit(0);
-
-            //printf("Next nk entry at offset 0x%x\n", convOff(hashes[i].offset));
-            fseek(regf, convOff(hashes[i].offset), SEEK_SET);
-            fread(next, sizeof(NK), 1, regf);
-            
-            // re-read it
-            int full_nk_size = sizeof(NK) + next->name_len - 1;
-            next = (NK *)realloc(next, full_nk_size);
-            fseek(regf, convOff(hashes[i].offset), SEEK_SET);
-            fread(next, full_nk_size, 1, regf);
-            
-            printSubTree(next, regf, level+1);
-
-            free(next);
+        uint32_t top = opts->key_path ? rv_lookupIndexKey(&idx, opts->key_path) : 0;
+        if (top == NO_KEY) {
+            rv_writeFmt(out, "Key not found: %s\n", opts->key_path);
+            ok = 0;
         }
+        else if (opts->index_stats)
+            rv_printIndexStats(&idx, out);
+        else
+            rv_printIndexTree(&idx, top, out);
+        rv_freeKeyIndex(&idx);
     }
-    else if (!strncmp(lh.signature, "ri", 2)) {
-        // Actually an ri record. These are lists of offsets
-        // to li/lh records
-        uint32_t *li_offsets = (uint32_t *)malloc(lh.num_entries * sizeof(uint32_t));
-        if (!li_offsets) exit(1);
-        int nread = fread(li_offsets, sizeof(uint32_t), lh.num_entries, regf);
-        if (nread < lh.num_entries) {
-            if(feof(regf))
-                printf("Unexpected EOF while reading file.\n");
-            if(ferror(regf)) {
-                printf("fread failed, file error.\n");
-                perror( "Read error (line 197)" );
-            }
-            exit(1);
+    else {
+        const NK *top = rv_findRoot(&hive);
+        if (!top) {
+            rv_writeFmt(out, "Root key not found.\n");
+            ok = 0;
         }
-        for(int i = 0; i < lh.num_entries; i++) {
-            LH lh2;
-            fseek(regf,convOff(li_offsets[i]),SEEK_SET);
-            //printf("Reading entry at %x\n", convOff(li_offsets[i]));
-            fread(&lh2, sizeof(LH), 1, regf);
-
-            if(!strncmp(lh2.signature, "lh", 2) || !strncmp(lh2.signature, "lf", 2)) {
-                //printf("%d entries in this lh/lf list\n", lh2.num_entries);
-
-                HashRec *hashes;
-                hashes = (HashRec *) malloc(lh2.num_entries * sizeof(HashRec));
-                if (!hashes) exit(1);
-
-                int nread = fread(hashes, sizeof(HashRec), lh2.num_entries, regf);
-                if (nread < lh2.num_entries) {
-                    if(feof(regf))
-                        printf("Unexpected EOF while reading file.\n");
-                    if(ferror(regf)) {
-                        perror( "Read error (line 223)" );
-                    }
-                    exit(1);
-                }
-
-                // Read the nk entry that each lh hash entry points to
-                // Note that since the length of the nk name is not known
-                // ahead of time we have to read the structure twice
-                for(int i = 0; i < lh2.num_entries; i++) {
-                    NK *next;
-                    next = (NK *)malloc(sizeof(NK));
-                    if (!next) exit(1);
-
-                    //printf("Next nk entry at offset 0x%x\n", convOff(hashes[i].offset));
-                    fseek(regf, convOff(hashes[i].offset), SEEK_SET);
-                    fread(next, sizeof(NK), 1, regf);
-                    
-                    // re-read it
-                    int full_nk_size = sizeof(NK) + next->name_len - 1;
-                    next = (NK *)realloc(next, full_nk_size);
-                    fseek(regf, convOff(hashes[i].offset), SEEK_SET);
-                    fread(next, full_nk_size, 1, regf);
-                    
-                    printSubTree(next, regf, level+1);
-
-                    free(next);
-                }
-            }
-            else if (!strncmp(lh2.signature, "li", 2)) {
-                //printf("%d entries in this li list\n", lh2.num_entries);
-                uint32_t *nk_offsets = (uint32_t *)malloc(lh2.num_entries * sizeof(uint32_t));
-                if (!nk_offsets) exit(1);
-                int nread = fread(nk_offsets, sizeof(uint32_t), lh2.num_entries, regf);
-                if (nread < lh2.num_entries) {
-                    if(feof(regf))
-                        printf("Unexpected EOF while reading file.\n");
-                    if(ferror(regf)) {
-                        perror("Read error (line 264)");
-                    }
-                    exit(1);
-                }
-                
-                for(int i = 0; i < lh2.num_entries; i++) {
-                    NK *next;
-                    next = (NK *)malloc(sizeof(NK));
-                    if (!next) exit(1);
-
-                    //printf("Next nk entry at offset 0x%x\n", convOff(hashes[i].offset));
-                    fseek(regf, convOff(nk_offsets[i]), SEEK_SET);
-                    fread(next, sizeof(NK), 1, regf);
-                    
-                    // re-read it
-                    int full_nk_size = sizeof(NK) + next->name_len - 1;
-                    next = (NK *)realloc(next, full_nk_size);
-                    fseek(regf, convOff(nk_offsets[i]), SEEK_SET);
-                    fread(next, full_nk_size, 1, regf);
-                    
-                    printSubTree(next, regf, level+1);
-
-                    free(next);
-                }
-                free(nk_offsets);
+        else if (opts->key_path && !(top = rv_lookupKey(&hive, top, opts->key_path))) {
+            rv_writeFmt(out, "Key not found: %s\n", opts->key_path);
+            ok = 0;
+        }
+        else if (opts->timeline)
+            rv_printTimeline(top, &hive, &opts->filter, opts->timeline, opts->nthreads,
+                opts->sort_mem, out);
+        else if (rv_filterActive(&opts->filter))
+            rv_printSubTreeFiltered(top, &hive, &opts->filter, opts->json, &opts->print, out);
+        else if (opts->json)
+            rv_printSubTreeJson(top, &hive, out);
+        else if (opts->nthreads > 1)
+            rv_printSubTreeParallel(top, &hive, 0, opts->nthreads, &opts->print, out);
+        else
+            rv_printSubTree(top, &hive, 0, &opts->print, out);
+    }
 
-            }
-            else {
-                printf("Fatal: encountered unknown subentry of ri list\n");
-                exit(1);
-            }
+    free(default_cache);
+    rv_closeHive(&hive);
+    return ok;
+}
+
+// Mount every hive opts asks for into one namespace and print from
+// it, as processHive does for one hive. Return value: 1 on success, 0
+// if a hive couldn't be mounted or the key asked for isn't there.
+int processMounts(const Options *opts, Writer *out) {
+    MountTable mt;
+    int ok = 1;
+
+    rv_initMountTable(&mt);
+    for (int i = 0; ok && i < opts->nmounts; i++) {
+        ok = rv_addMount(&mt, opts->mounts[i], out);
+    }
+    if (!ok) {
+        rv_freeMountTable(&mt);
+        return 0;
+    }
+
+    if (opts->use_index || opts->index_stats) {
+        KeyIndex idx;
+        rv_buildMountIndex(&mt, &idx);
+        uint32_t top = opts->key_path ? rv_lookupIndexKey(&idx, opts->key_path) : 0;
+        if (top == NO_KEY) {
+            rv_writeFmt(out, "Key not found: %s\n", opts->key_path);
+            ok = 0;
+        }
+        else if (opts->index_stats)
+            rv_printIndexStats(&idx, out);
+        else if (top)
+            rv_printIndexTree(&idx, top, out);
+        else {
+            // The top of the namespace has no name to print
+            for (uint32_t i = idx.keys[0].first_child; i != NO_KEY; i = idx.keys[i].next_sibling)
+                rv_printIndexTree(&idx, i, out);
         }
-        free(li_offsets);
+        rv_freeKeyIndex(&idx);
     }
-    else {
-        printf("Fatal: encountered unknown subkey type\n");
-        exit(1);
+    else if (!rv_printMountTree(&mt, opts->key_path, opts->nthreads, &opts->print, out)) {
+        rv_writeFmt(out, "Key not found: %s\n", opts->key_path);
+        ok = 0;
     }
-    return;
+    rv_freeMountTable(&mt);
+    return ok;
 }
 
-// Validate a hive header by checking its checksum and
-// signature. Return value: 1 for valid, 0 for invalid.
-int validHeader(HiveHeader *hdr) {
-    if (strncmp(hdr->signature, "regf", 4)) {
-        printf("Invalid header.\n");
+// Open a hive for diffing and find the key to start from. Return
+// value: 1 on success, 0 after printing why not.
+int openDiffSide(Hive *hive, const char *path, const char *key_path,
+    const NK **top, Writer *out) {
+    if (!rv_openHive(hive, path, 0, out)) {
         return 0;
     }
-
-    uint32_t cksum = 0;
-    uint32_t *cur = (uint32_t *) hdr;
-    for (int i = 0; i < sizeof(HiveHeader)-4; i += 4) {
-        cksum ^= *cur;
-        cur++;
+    if (!rv_validHeader((const HiveHeader *) hive->base, out)) {
+        rv_writeFmt(out, "%s: registry file failed basic validation.\n", path);
+        rv_closeHive(hive);
+        return 0;
     }
-    
-    if (cksum != hdr->checksum) {
-        printf("Bad checksum.\n");
+    rv_replayLogs(hive, path, NULL, 0, out);
+    if (!(*top = rv_findRoot(hive))) {
+        rv_writeFmt(out, "%s: root key not found.\n", path);
+        rv_closeHive(hive);
         return 0;
     }
+    if (key_path && !(*top = rv_lookupKey(hive, *top, key_path))) {
+        rv_writeFmt(out, "%s: key not found: %s\n", path, key_path);
+        rv_closeHive(hive);
+        return 0;
+    }
+    return 1;
+}
 
+// Print the differences between the hives at path_a and path_b.
+// Return value: 1 on success, 0 if either side couldn't be opened.
+int processDiff(const char *path_a, const char *path_b, const Options *opts, Writer *out) {
+    Hive a, b;
+    const NK *ra, *rb;
+
+    if (!openDiffSide(&a, path_a, opts->key_path, &ra, out)) {
+        return 0;
+    }
+    if (!openDiffSide(&b, path_b, opts->key_path, &rb, out)) {
+        rv_closeHive(&a);
+        return 0;
+    }
+    rv_diffTrees(&a, ra, &b, rb, opts->diff_prune, out);
+    rv_closeHive(&b);
+    rv_closeHive(&a);
     return 1;
 }
 
-int main(int argc, char **argv) {
-    
-    if(argc < 2) {
-        printf("Usage: %s <registry file>\n", argv[0]);
-        exit(1);
+// Batch mode: a pool of threads takes hives off a shared list, each
+// printing one whole hive into memory. A finished hive's output is
+// written in one piece under a header line, so small hives come out
+// as soon as they're done rather than queueing behind big ones.
+typedef struct batch {
+    char **paths;
+    int npaths;
+    int next;
+    int failed;
+    const Options *opts;
+    Writer *out;
+    pthread_mutex_t lock;
+} Batch;
+
+void *batchWorker(void *arg) {
+    Batch *b = (Batch *) arg;
+
+    while (1) {
+        pthread_mutex_lock(&b->lock);
+        int i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+        if (i >= b->npaths) break;
+
+        Writer hout;
+        rv_initWriter(&hout, NULL, NULL);
+        if (b->opts->json) {
+            rv_writeStr(&hout, "{\"hive\":");
+            rv_writeJsonString(&hout, b->paths[i]);
+            rv_writeStr(&hout, "}\n");
+        }
+        else {
+            rv_writeFmt(&hout, "==> %s <==\n", b->paths[i]);
+        }
+        // A damaged hive fails on its own rather than ending the batch
+        rv_hive_error_out = &hout;
+        rv_hive_errors = 0;
+        int ok = processHive(b->paths[i], b->opts, &hout) && !rv_hive_errors;
+        rv_hive_error_out = NULL;
+
+        pthread_mutex_lock(&b->lock);
+        if (!ok) b->failed++;
+        rv_writeBytes(b->out, hout.buf, hout.len);
+        rv_flushWriter(b->out);
+        pthread_mutex_unlock(&b->lock);
+        rv_freeWriter(&hout);
     }
+    rv_mergeStats();
+    return NULL;
+}
 
-    FILE *regf;
-    HiveHeader hdr;
-    BlockHeader bh;
+// Read a list of hive paths, one per line, from stdin
+char **readPathList(int *npaths) {
+    char **paths = NULL;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    int cap = 0;
+
+    *npaths = 0;
+    while ((len = getline(&line, &line_cap, stdin)) >= 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (!len) continue;
+        if (*npaths == cap) {
+            cap = cap ? cap * 2 : 64;
+            paths = (char **) realloc(paths, cap * sizeof(char *));
+            if (!paths) exit(1);
+        }
+        paths[(*npaths)++] = strdup(line);
+    }
+    free(line);
+    return paths;
+}
 
-    regf = fopen(argv[1], "rb");
-    
-    if (!regf) {
-        perror("fopen");
-        exit(1);
+// Process every hive in paths on a pool of nthreads threads. Return
+// value: the number of hives that couldn't be processed.
+int processBatch(char **paths, int npaths, int nthreads, const Options *opts, Writer *out) {
+    Batch b;
+    Options hive_opts = *opts;
+
+    // The pool is the parallelism; each hive is walked on one thread
+    hive_opts.nthreads = 1;
+    b.paths = paths;
+    b.npaths = npaths;
+    b.next = 0;
+    b.failed = 0;
+    b.opts = &hive_opts;
+    b.out = out;
+    pthread_mutex_init(&b.lock, NULL);
+
+    if (nthreads > npaths) nthreads = npaths;
+    pthread_t *threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+    if (!threads) exit(1);
+    for (int t = 0; t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, batchWorker, &b)) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
     }
+    pthread_mutex_destroy(&b.lock);
+    free(threads);
+    return b.failed;
+}
 
-    // Read in the global header
-    fread(&hdr, sizeof(HiveHeader), 1, regf);
-    if(!validHeader(&hdr)) {
-        printf("Registry file failed basic validation.\n");
-        exit(1);
+// Print the --stats report, to stderr so it stays out of the output
+void printStats(void) {
+    static const char *const list_names[4] = { "lf", "lh", "li", "ri" };
+    FdSink sink = { 2, 0 };
+    Writer w;
+    Stats *t = &rv_total_stats;
+
+    rv_mergeStats();
+    rv_initWriter(&w, rv_fdSinkWrite, &sink);
+    rv_writeFmt(&w, "keys visited     %12llu\n", (unsigned long long) t->keys);
+    rv_writeFmt(&w, "max depth        %12u\n", t->max_depth);
+    rv_writeFmt(&w, "cell reads       %12llu\n", (unsigned long long) t->cell_reads);
+    rv_writeFmt(&w, "bytes read       %12llu\n", (unsigned long long) t->bytes_read);
+    rv_writeFmt(&w, "far jumps        %12llu\n", (unsigned long long) t->far_jumps);
+    for (int i = 0; i < 4; i++)
+        rv_writeFmt(&w, "%s lists         %12llu\n", list_names[i], (unsigned long long) t->lists[i]);
+    rv_writeFmt(&w, "allocations      %12llu\n", (unsigned long long) t->allocs);
+    if (rv_prefetch_cells)
+        rv_writeFmt(&w, "prefetches       %12llu\n", (unsigned long long) t->prefetches);
+    // Summed over threads, not counting output written mid-walk
+    rv_writeFmt(&w, "walk time        %12.3f ms\n", (t->walk_ns - t->walk_output_ns) / 1e6);
+    rv_writeFmt(&w, "output time      %12.3f ms\n", t->output_ns / 1e6);
+    rv_writeStr(&w, "subkeys per key:\n");
+    for (int i = 0; i < FANOUT_BUCKETS; i++) {
+        if (!t->fanout[i]) continue;
+        char range[32];
+        if (i < 2) snprintf(range, sizeof(range), "%d", i);
+        else if (i == FANOUT_BUCKETS - 1) snprintf(range, sizeof(range), "%u+", 1u << (i - 1));
+        else snprintf(range, sizeof(range), "%u-%u", 1u << (i - 1), (1u << i) - 1);
+        rv_writeFmt(&w, "%16s %12llu\n", range, (unsigned long long) t->fanout[i]);
     }
-    printNTTime(&hdr.modified);
-
-    fseek(regf, 0x1000, SEEK_SET);
-    fread(&bh, sizeof(BlockHeader), 1, regf);
-
-    //printNTTime(&bh.modified);
-
-    // find root nk cell
-    int cell_size = -1;
-    NK *root;
-    while(1) {
-        // If we're at a page boundary, see if we need to skip an hbin header
-        // This should really never happen (the root key should be within the
-        // first block), but better to be safe...
-        if((ftell(regf) % 0x1000) == 0) {
-            int32_t pos = ftell(regf);
-            fread(&bh, sizeof(BlockHeader), 1, regf);
-            if(strncmp(bh.signature,"hbin",4)) { // whoops, we were wrong, seek back
-                fseek(regf, pos, SEEK_SET);
-            }
-        }
-            
-        fread(&cell_size, sizeof(int), 1, regf);
-
-        // Haven't seen this documented anywhere: it appears that the cell size
-        // is stored as a signed int and is -1 * the actual size. This is noted
-        // in WinReg.txt, but the author there seems to indicate that this is
-        // only the case for free blocks; this is clearly not the case here.
-        int32_t cell_size_real = (-1*cell_size) - sizeof(int);
-        if (cell_size_real < 0 || cell_size_real > 0x1000) exit(1);
-        char *buf = (char*)malloc(cell_size_real);
-        if (!buf) exit(1);
-        fread(buf, cell_size_real, 1, regf);
-        if(!strncmp(buf, "nk", 2)) {
-            root = (NK *) buf;      
-            if(root->type == NK_ROOT) {
-                break;
-            }
-            else {
-                free(buf);
-            }
+    rv_freeWriter(&w);
+}
+
+void usage(const char *prog) {
+    printf("Usage: %s [-j threads] [-v] [-s] [-o file] [--json] [--sweep] [--carve] [--verify]\n"
+        "       [--index] [--index-stats] [--cache[=file]] [--log file]... [--match glob] [--depth n]\n"
+        "       [--after time] [--before time] [--stats] [--prefetch]\n"
+        "       [--timeline[=bodyfile|csv]] [--sort-mem MB] <registry file> [key path]\n"
+        "       %s --batch [options] [registry file...]\n"
+        "       %s --diff [--prune] [-o file] <old file> <new file> [key path]\n"
+        "       %s --mount vpath=file... [-j threads] [-v] [-s] [-o file] [--index]\n"
+        "       [--index-stats] [--stats] [--prefetch] [key path]\n", prog, prog, prog, prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    Options opts;
+    const char *out_path = NULL;
+    int batch = 0;
+    int diff = 0;
+    int opt;
+    static const struct option longopts[] = {
+        { "values", no_argument, NULL, 'v' },
+        { "security", no_argument, NULL, 's' },
+        { "output", required_argument, NULL, 'o' },
+        { "json", no_argument, NULL, 'J' },
+        { "sweep", no_argument, NULL, 'S' },
+        { "carve", no_argument, NULL, 'K' },
+        { "verify", no_argument, NULL, 'V' },
+        { "timeline", optional_argument, NULL, 'E' },
+        { "sort-mem", required_argument, NULL, 'm' },
+        { "index", no_argument, NULL, 'I' },
+        { "index-stats", no_argument, NULL, 'X' },
+        { "cache", optional_argument, NULL, 'C' },
+        { "batch", no_argument, NULL, 'B' },
+        { "diff", no_argument, NULL, 'D' },
+        { "prune", no_argument, NULL, 'R' },
+        { "log", required_argument, NULL, 'L' },
+        { "stats", no_argument, NULL, 'T' },
+        { "prefetch", no_argument, NULL, 'P' },
+        { "match", required_argument, NULL, 'M' },
+        { "depth", required_argument, NULL, 'd' },
+        { "after", required_argument, NULL, 'a' },
+        { "before", required_argument, NULL, 'b' },
+        { "mount", required_argument, NULL, 'N' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    memset(&opts, 0, sizeof(opts));
+    rv_initKeyFilter(&opts.filter);
+    opts.sort_mem = (size_t) 256 << 20;
+    opts.nthreads = 0;
+    while ((opt = getopt_long(argc, argv, "j:vso:", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+            opts.nthreads = atoi(optarg);
+            if (opts.nthreads < 1) usage(argv[0]);
+            break;
+        case 'v':
+            opts.print.values = 1;
+            break;
+        case 's':
+            opts.print.security = 1;
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'J':
+            opts.json = 1;
+            break;
+        case 'S':
+            opts.sweep = 1;
+            break;
+        case 'K':
+            opts.carve = 1;
+            break;
+        case 'V':
+            opts.verify = 1;
+            break;
+        case 'E':
+            if (!optarg || !strcmp(optarg, "bodyfile")) opts.timeline = TIMELINE_BODYFILE;
+            else if (!strcmp(optarg, "csv")) opts.timeline = TIMELINE_CSV;
+            else usage(argv[0]);
+            break;
+        case 'm':
+            if (atoi(optarg) < 1) usage(argv[0]);
+            opts.sort_mem = (size_t) atoi(optarg) << 20;
+            break;
+        case 'I':
+            opts.use_index = 1;
+            break;
+        case 'X':
+            opts.index_stats = 1;
+            break;
+        case 'C':
+            opts.use_cache = 1;
+            opts.cache_path = optarg;
+            break;
+        case 'B':
+            batch = 1;
+            break;
+        case 'D':
+            diff = 1;
+            break;
+        case 'R':
+            opts.diff_prune = 1;
+            break;
+        case 'L':
+            if (opts.nlogs == 2) usage(argv[0]);
+            opts.logs[opts.nlogs++] = optarg;
+            break;
+        case 'T':
+            rv_collect_stats = 1;
+            break;
+        case 'P':
+            rv_prefetch_cells = 1;
+            break;
+        case 'M':
+            rv_setFilterGlob(&opts.filter, optarg);
+            break;
+        case 'd':
+            opts.filter.max_depth = atoi(optarg);
+            if (opts.filter.max_depth < 0) usage(argv[0]);
+            break;
+        case 'a':
+            if (!rv_parseFilterTime(optarg, &opts.filter.after)) usage(argv[0]);
+            break;
+        case 'b':
+            if (!rv_parseFilterTime(optarg, &opts.filter.before)) usage(argv[0]);
+            break;
+        case 'N':
+            if (!opts.mounts) opts.mounts = (const char **) malloc(argc * sizeof(char *));
+            if (!opts.mounts) exit(1);
+            opts.mounts[opts.nmounts++] = optarg;
+            break;
+        default:
+            usage(argv[0]);
         }
     }
 
-    printSubTree(root, regf, 0);
+    if (opts.nmounts) {
+        // Only the tree and the index cover more than one hive at once
+        if (batch || diff || opts.json || opts.sweep || opts.carve || opts.verify ||
+            opts.timeline || opts.use_cache || opts.nlogs || rv_filterActive(&opts.filter) ||
+            argc - optind > 1)
+            usage(argv[0]);
+        opts.key_path = optind < argc ? argv[optind] : NULL;
+        if (!opts.nthreads) opts.nthreads = 1;
+        rv_openOutput(out_path);
+        int ok = processMounts(&opts, &rv_output);
+        rv_closeOutput();
+        if (rv_collect_stats) printStats();
+        free(opts.mounts);
+        return ok ? 0 : 1;
+    }
 
-    fclose(regf);
+    if (diff) {
+        // Logs are only ever looked for next to each hive
+        if (batch || opts.nlogs || argc - optind < 2 || argc - optind > 3) usage(argv[0]);
+        opts.key_path = argc - optind > 2 ? argv[optind + 2] : NULL;
+        rv_openOutput(out_path);
+        int ok = processDiff(argv[optind], argv[optind + 1], &opts, &rv_output);
+        rv_closeOutput();
+        if (rv_collect_stats) printStats();
+        return ok ? 0 : 1;
+    }
+
+    if (batch) {
+        char **paths = argv + optind;
+        int npaths = argc - optind;
+        int nthreads = opts.nthreads;
+        char **list = NULL;
+
+        // One cache file or log can't serve more than one hive
+        if (opts.cache_path || opts.nlogs) usage(argv[0]);
+        if (!npaths) paths = list = readPathList(&npaths);
+        if (!nthreads) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthreads < 1) nthreads = 1;
+
+        rv_openOutput(out_path);
+        int failed = npaths ? processBatch(paths, npaths, nthreads, &opts, &rv_output) : 0;
+        rv_closeOutput();
+        if (rv_collect_stats) printStats();
+        for (int i = 0; list && i < npaths; i++) free(list[i]);
+        free(list);
+        return failed ? 1 : 0;
+    }
+
+    if(optind >= argc || argc - optind > 2) {
+        usage(argv[0]);
+    }
+    opts.key_path = argc - optind > 1 ? argv[optind + 1] : NULL;
+    if (!opts.nthreads) opts.nthreads = 1;
+
+    rv_openOutput(out_path);
+    int ok = processHive(argv[optind], &opts, &rv_output);
+    rv_closeOutput();
+    if (rv_collect_stats) printStats();
+    if (!ok) {
+        exit(1);
+    }
     return 0;
 }
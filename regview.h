@@ -0,0 +1,75 @@
+// libregview: read-only access to Windows registry hive files.
+//
+// A hive is opened once and walked with cursors. A cursor sits on one
+// key and steps to its first subkey, its next sibling or its parent;
+// each step reads only the cells it needs and costs the same however
+// big the hive is. Names and value data point into the hive's mapping
+// rather than being copied, so they stay valid until the hive is
+// closed, except where noted below. Names are always given as UTF-8.
+//
+// Functions that can fail return 1 on success and 0 on failure, which
+// for cursor moves includes there being nowhere to move to. Nothing
+// here prints or exits because a hive is damaged. One cursor must not
+// be used from two threads at once, but any number of cursors can walk
+// the same hive in parallel.
+#ifndef REGVIEW_H
+#define REGVIEW_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define REG_NONE 0
+#define REG_SZ 1
+#define REG_EXPAND_SZ 2
+#define REG_BINARY 3
+#define REG_DWORD 4
+#define REG_DWORD_BIG_ENDIAN 5
+#define REG_LINK 6
+#define REG_MULTI_SZ 7
+#define REG_QWORD 11
+
+typedef struct rvHive RvHive;
+typedef struct rvCursor RvCursor;
+
+// One value of a key. The name is not NUL terminated, and is empty
+// for the key's default value.
+typedef struct rvValue {
+    const char *name;
+    size_t name_len;
+    uint32_t type;              // REG_SZ, REG_DWORD, ...
+    const unsigned char *data;
+    size_t len;
+} RvValue;
+
+// Open the hive at path, bringing it up to date from any transaction
+// logs next to it, and check that its root key can be found. A path of
+// "-", or a pipe, is read through to the end first.
+int rvOpenHive(const char *path, RvHive **hive);
+void rvCloseHive(RvHive *hive);
+
+// Cursors start on the hive's root key, at depth 0. A hive must
+// outlive its cursors.
+int rvCursorOpen(RvHive *hive, RvCursor **cursor);
+void rvCursorClose(RvCursor *c);
+
+// Moves. On failure the cursor stays where it was.
+int rvCursorFirstChild(RvCursor *c);
+int rvCursorNextSibling(RvCursor *c);
+int rvCursorParent(RvCursor *c);
+
+// The key under the cursor. A name stored as UTF-16, or as Latin-1
+// with anything outside ASCII in it, is decoded into memory owned by
+// the cursor, which is only valid until its next call to rvCursorName.
+int rvCursorDepth(const RvCursor *c);
+const char *rvCursorName(RvCursor *c, size_t *len);
+uint64_t rvCursorModified(const RvCursor *c);   // FILETIME ticks
+uint32_t rvCursorNumSubkeys(const RvCursor *c);
+uint32_t rvCursorNumValues(const RvCursor *c);
+
+// Fetch value i of the key under the cursor. A name that needs
+// decoding, and data that the hive splits over several cells, are put
+// together in memory owned by the cursor, and are only valid until its
+// next call to rvCursorValue.
+int rvCursorValue(RvCursor *c, uint32_t i, RvValue *value);
+
+#endif